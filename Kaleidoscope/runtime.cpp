@@ -0,0 +1,9 @@
+// Runtime helpers callable from Kaleidoscope. Linked into toy, and built
+// to runtime.bc (make runtime.bc) so -prelude=runtime.bc can inline them.
+#include <cstdio>
+
+extern "C"
+double putchard(double x) {
+  putchar((char)x);
+  return 0;
+}
@@ -1,61 +1,558 @@
+#include <algorithm>
 #include <cctype>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <string>
+#include <unordered_map>
 #include <vector>
+#include <sys/stat.h>
+#include <sys/un.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "toyproto.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/Analysis/Passes.h"
+#include "llvm/Bitcode/ReaderWriter.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
 #include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Target/TargetOptions.h"
+#include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Vectorize.h"
 
 using namespace llvm;
 
+// Command line options
+
+namespace {
+  cl::opt<std::string>
+  MCPU("mcpu",
+       cl::desc("Target a specific cpu type instead of the host cpu (e.g. -mcpu=generic)"),
+       cl::value_desc("cpu-name"),
+       cl::init(""));
+
+  cl::list<std::string>
+  MAttrs("mattr",
+         cl::CommaSeparated,
+         cl::desc("Target specific attributes added on top of the cpu's"),
+         cl::value_desc("a1,+a2,-a3,..."));
+
+  cl::opt<bool>
+  FastMath("ffast-math",
+           cl::desc("Allow reassociation and other value-unsafe floating-point "
+                    "transforms; implies -fno-honor-nans -fno-honor-infinities "
+                    "and -ffp-contract=fast"),
+           cl::init(false));
+
+  cl::opt<bool>
+  NoHonorNaNs("fno-honor-nans",
+              cl::desc("Assume floating-point values are never NaN"),
+              cl::init(false));
+
+  cl::opt<bool>
+  NoHonorInfs("fno-honor-infinities",
+              cl::desc("Assume floating-point values are never +-Inf"),
+              cl::init(false));
+
+  cl::opt<FPOpFusion::FPOpFusionMode>
+  FPContract("ffp-contract",
+             cl::desc("Contract a*b+c into fused multiply-adds (default: off)"),
+             cl::init(FPOpFusion::Strict),
+             cl::values(
+               clEnumValN(FPOpFusion::Fast, "fast", "Fuse wherever profitable"),
+               clEnumValN(FPOpFusion::Standard, "on", "Only fuse a*b+c written in the source"),
+               clEnumValN(FPOpFusion::Strict, "off", "Never fuse (strict IEEE)"),
+               clEnumValEnd));
+
+  cl::opt<std::string>
+  SnapshotPath("snapshot",
+               cl::desc("Save every compiled module to this file on exit"),
+               cl::value_desc("filename"));
+
+  cl::opt<std::string>
+  RestorePath("restore",
+              cl::desc("Start from a -snapshot file instead of an empty session"),
+              cl::value_desc("filename"));
+
+  cl::opt<bool>
+  Tiered("tiered",
+         cl::desc("Profile defs and recompile hot ones in the background with the profile"),
+         cl::init(false));
+
+  cl::opt<unsigned>
+  HotThreshold("hot-threshold",
+               cl::desc("Calls after which -tiered recompiles a def"),
+               cl::init(10000));
+
+  cl::opt<unsigned>
+  SpecializePercent("specialize-percent",
+                    cl::desc("-tiered specializes a def on an argument that has the same value "
+                             "in this percentage of calls (0 disables)"),
+                    cl::init(95));
+
+  cl::opt<unsigned>
+  MemoCacheBits("memo-cache-bits",
+                cl::desc("Each memo def caches up to 2^N results, for N in 1..20 (default 12)"),
+                cl::init(12));
+
+  cl::list<std::string>
+  HostArrays("array",
+             cl::desc("Bind a zero-filled host buffer of N numbers as the global array 'name'"),
+             cl::value_desc("name=N"));
+
+  cl::list<std::string>
+  Preludes("prelude",
+           cl::desc("Link defs and runtime helpers from a bitcode library into every session"),
+           cl::value_desc("filename.bc"));
+
+  cl::opt<std::string>
+  EmitPrelude("emit-prelude",
+              cl::desc("On exit, write the session's defs as a bitcode library for -prelude"),
+              cl::value_desc("filename.bc"));
+
+  cl::opt<std::string>
+  ServePath("serve",
+            cl::desc("Serve evaluation requests on a Unix domain socket instead of reading stdin"),
+            cl::value_desc("socket-path"));
+
+  cl::opt<unsigned>
+  NumWorkers("workers",
+             cl::desc("Number of connections -serve handles at once"),
+             cl::init(4));
+
+  cl::opt<std::string>
+  InputFile(cl::Positional,
+            cl::desc("<input file>"),
+            cl::init("-"));
+
+  cl::opt<bool>
+  Watch("watch",
+        cl::desc("Run the input file, then rerun only what changed each time it is saved"),
+        cl::init(false));
+
+  cl::opt<bool>
+  LexBench("lex-bench",
+           cl::desc("Time lexing the input file from memory and as a stream, then exit"),
+           cl::init(false));
+
+  cl::opt<bool>
+  NumberBench("number-bench",
+              cl::desc("Time number literal parsing against a std::string + strtod copy, then exit"),
+              cl::init(false));
+
+  cl::opt<std::string>
+  BatchKernel("batch-kernel",
+              cl::desc("After the input has run, time def 'name' as a columnar kernel against "
+                       "one call per row, and check that they agree"),
+              cl::value_desc("name"));
+
+  cl::opt<unsigned>
+  KernelRows("kernel-rows",
+             cl::desc("Rows of generated input -batch-kernel evaluates (default 1000000)"),
+             cl::init(1000000));
+
+  cl::opt<bool>
+  Batch("batch",
+        cl::desc("Read the whole input first and only compile defs that a top-level "
+                 "expression or -export can reach"),
+        cl::init(false));
+
+  cl::opt<unsigned>
+  ParseThreads("parse-threads",
+               cl::desc("Threads -batch parses a large input with (default: one per core)"),
+               cl::init(0));
+
+  cl::list<std::string>
+  Exports("export",
+          cl::CommaSeparated,
+          cl::desc("Defs -batch keeps for -snapshot/-emit-prelude (default: all of them "
+                   "when saving, none otherwise)"),
+          cl::value_desc("name,..."));
+}
+
+static FPOpFusion::FPOpFusionMode getFPContractMode() {
+  if(FastMath && FPContract.getNumOccurrences() == 0) return FPOpFusion::Fast;
+  return FPContract;
+}
+
+static FastMathFlags getFastMathFlags() {
+  FastMathFlags FMF;
+  if(FastMath) FMF.setUnsafeAlgebra();
+  if(FastMath || NoHonorNaNs) FMF.setNoNaNs();
+  if(FastMath || NoHonorInfs) FMF.setNoInfs();
+  return FMF;
+}
+
 // Lexer
 
 enum Token {
   tok_eof = -1,
   tok_def = -2, tok_extern = -3,
-  tok_identifier = -4, tok_number = -5
+  tok_identifier = -4, tok_number = -5,
+  tok_if = -6, tok_then = -7, tok_else = -8,
+  tok_for = -9, tok_in = -10,
+  tok_var = -11, tok_memo = -12,
+  tok_error = -13
+};
+
+// Byte classes in the C locale, for a table lookup instead of the
+// locale-dependent <cctype> calls.
+enum { CC_Space = 1, CC_Alpha = 2, CC_Digit = 4, CC_Dot = 8, CC_Newline = 16 };
+
+static constexpr unsigned char classifyChar(unsigned C) {
+  return (C == ' ' || (C >= '\t' && C <= '\r') ? CC_Space : 0) |
+         ((C | 0x20) >= 'a' && (C | 0x20) <= 'z' ? CC_Alpha : 0) |
+         (C >= '0' && C <= '9' ? CC_Digit : 0) |
+         (C == '.' ? CC_Dot : 0) |
+         (C == '\n' || C == '\r' ? CC_Newline : 0);
+}
+
+#define CC4(i) classifyChar(i), classifyChar(i + 1), classifyChar(i + 2), classifyChar(i + 3)
+#define CC16(i) CC4(i), CC4(i + 4), CC4(i + 8), CC4(i + 12)
+#define CC64(i) CC16(i), CC16(i + 16), CC16(i + 32), CC16(i + 48)
+static constexpr unsigned char CharClass[256] = { CC64(0), CC64(64), CC64(128), CC64(192) };
+#undef CC64
+#undef CC16
+#undef CC4
+
+static inline bool inClass(int C, unsigned Class) {
+  return C != EOF && (CharClass[(unsigned char)C] & Class);
+}
+
+// Whole vectors of source are classified at once where the target has
+// SSE2 (16 bytes) or, when built with -mavx2, AVX2 (32 bytes).
+#if defined(__AVX2__)
+typedef __m256i LexVec;
+static const unsigned LexVecBytes = 32;
+static inline LexVec lexLoad(const char *P) { return _mm256_loadu_si256((const __m256i *)P); }
+static inline LexVec lexSplat(char C) { return _mm256_set1_epi8(C); }
+static inline LexVec lexEq(LexVec A, LexVec B) { return _mm256_cmpeq_epi8(A, B); }
+static inline LexVec lexOr(LexVec A, LexVec B) { return _mm256_or_si256(A, B); }
+static inline LexVec lexSub(LexVec A, LexVec B) { return _mm256_sub_epi8(A, B); }
+static inline LexVec lexMinU(LexVec A, LexVec B) { return _mm256_min_epu8(A, B); }
+static inline uint32_t lexMask(LexVec V) { return (uint32_t)_mm256_movemask_epi8(V); }
+#elif defined(__SSE2__)
+typedef __m128i LexVec;
+static const unsigned LexVecBytes = 16;
+static inline LexVec lexLoad(const char *P) { return _mm_loadu_si128((const __m128i *)P); }
+static inline LexVec lexSplat(char C) { return _mm_set1_epi8(C); }
+static inline LexVec lexEq(LexVec A, LexVec B) { return _mm_cmpeq_epi8(A, B); }
+static inline LexVec lexOr(LexVec A, LexVec B) { return _mm_or_si128(A, B); }
+static inline LexVec lexSub(LexVec A, LexVec B) { return _mm_sub_epi8(A, B); }
+static inline LexVec lexMinU(LexVec A, LexVec B) { return _mm_min_epu8(A, B); }
+static inline uint32_t lexMask(LexVec V) { return (uint32_t)_mm_movemask_epi8(V); }
+#endif
+
+#ifdef __SSE2__
+// Bytes of V in [Lo, Lo + Width], compared unsigned after the subtraction.
+static inline LexVec lexInRange(LexVec V, char Lo, char Width) {
+  LexVec T = lexSub(V, lexSplat(Lo));
+  return lexEq(lexMinU(T, lexSplat(Width)), T);
+}
+
+// Bit i is set when byte i of P is in one of the classes; the same
+// classification as CharClass. Class is a constant after inlining.
+static inline uint32_t lexClassMask(const char *P, unsigned Class) {
+  LexVec V = lexLoad(P);
+  LexVec M = lexSplat(0);
+  if(Class & CC_Space) M = lexOr(M, lexOr(lexEq(V, lexSplat(' ')), lexInRange(V, '\t', '\r' - '\t')));
+  if(Class & CC_Alpha) M = lexOr(M, lexInRange(lexOr(V, lexSplat(0x20)), 'a', 'z' - 'a'));
+  if(Class & CC_Digit) M = lexOr(M, lexInRange(V, '0', 9));
+  if(Class & CC_Dot) M = lexOr(M, lexEq(V, lexSplat('.')));
+  if(Class & CC_Newline) M = lexOr(M, lexOr(lexEq(V, lexSplat('\n')), lexEq(V, lexSplat('\r'))));
+  return lexMask(M);
+}
+#endif
+
+// Returns the first byte in [P, End) that is (Member false) or is not
+// (Member true) in Class.
+static inline const char *scanClass(const char *P, const char *End, unsigned Class, bool Member) {
+  // Most runs in source are short: a single space, a short name.
+  for(unsigned i = 0; i != 4; ++i, ++P) {
+    if(P == End || bool(CharClass[(unsigned char)*P] & Class) != Member) return P;
+  }
+#ifdef __SSE2__
+  const uint32_t AllBytes = LexVecBytes == 32 ? ~0u : 0xffffu;
+  for(; End - P >= (ptrdiff_t)LexVecBytes; P += LexVecBytes) {
+    // Bytes that end the run.
+    uint32_t Stop = lexClassMask(P, Class);
+    if(Member) Stop = ~Stop & AllBytes;
+    if(Stop) return P + countTrailingZeros(Stop);
+  }
+#endif
+  while(P != End && bool(CharClass[(unsigned char)*P] & Class) == Member) ++P;
+  return P;
+}
+
+// Number literals:
+//   decimal  digits ['.' digits] [('e'|'E') ['+'|'-'] digits], or '.' digits
+//   hex      '0x' hexdigits ['.' hexdigits] [('p'|'P') ['+'|'-'] digits]
+// parseNumber returns the end of the literal starting at P, or NULL when
+// it is malformed, e.g. "1e" or "0x.p1". Values that are exact in a double
+// after at most one rounding (Clinger's fast path: a mantissa below 2^53
+// times an exact power of ten, or a hex mantissa scaled by a power of two)
+// are computed directly; others go to strtod, which rounds correctly.
+static const double ExactPowersOf10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline int hexDigitValue(unsigned char C) {
+  if(CharClass[C] & CC_Digit) return C - '0';
+  C |= 0x20;
+  return C >= 'a' && C <= 'f' ? C - 'a' + 10 : -1;
+}
+
+// Parses ('+'|'-')? digits at P into Exp, saturating; NULL if no digits.
+static const char *parseExponent(const char *P, const char *End, int &Exp) {
+  bool Negative = false;
+  if(P != End && (*P == '+' || *P == '-')) Negative = *P++ == '-';
+  const char *Digits = P;
+  Exp = 0;
+  for(; P != End && (CharClass[(unsigned char)*P] & CC_Digit); ++P) {
+    if(Exp < 100000) Exp = Exp * 10 + (*P - '0');
+  }
+  if(P == Digits) return 0;
+  if(Negative) Exp = -Exp;
+  return P;
+}
+
+static double slowParseNumber(const char *Start, const char *End) {
+  char Buf[64];
+  size_t Len = End - Start;
+  if(Len < sizeof(Buf)) {
+    memcpy(Buf, Start, Len);
+    Buf[Len] = 0;
+    return strtod(Buf, 0);
+  }
+  return strtod(std::string(Start, End).c_str(), 0);
+}
+
+static const char *parseHexNumber(const char *Start, const char *End, double &Val) {
+  const char *P = Start + 2;
+  uint64_t Mantissa = 0;
+  int Exp2 = 0, NumDigits = 0, D;
+  bool Truncated = false, SeenDot = false;
+  for(; P != End; ++P) {
+    if(*P == '.' && !SeenDot) {
+      SeenDot = true;
+      continue;
+    }
+    if((D = hexDigitValue(*P)) < 0) break;
+    ++NumDigits;
+    if(Mantissa >> 60) {
+      Truncated |= D != 0;
+      if(!SeenDot) Exp2 += 4;
+    } else {
+      Mantissa = Mantissa << 4 | D;
+      if(SeenDot) Exp2 -= 4;
+    }
+  }
+  if(!NumDigits) return 0;
+  if(P != End && (*P | 0x20) == 'p') {
+    int Exp;
+    if(!(P = parseExponent(P + 1, End, Exp))) return 0;
+    Exp2 += Exp;
+  }
+  if(!Truncated && Mantissa < (1ULL << 53)) Val = ldexp((double)Mantissa, Exp2);
+  else Val = slowParseNumber(Start, P);
+  return P;
+}
+
+static const char *parseNumber(const char *Start, const char *End, double &Val) {
+  if(End - Start > 2 && Start[0] == '0' && (Start[1] | 0x20) == 'x') return parseHexNumber(Start, End, Val);
+
+  const char *P = Start;
+  uint64_t Mantissa = 0;
+  int Exp10 = 0, NumDigits = 0;
+  bool Truncated = false, SeenDot = false;
+  for(; P != End; ++P) {
+    unsigned char C = *P;
+    if(C == '.' && !SeenDot) {
+      SeenDot = true;
+      continue;
+    }
+    if(!(CharClass[C] & CC_Digit)) break;
+    ++NumDigits;
+    // Past 18 digits only the decimal exponent and stickiness are kept.
+    if(Mantissa >= 100000000000000000ULL) {
+      Truncated |= C != '0';
+      if(!SeenDot) ++Exp10;
+    } else {
+      Mantissa = Mantissa * 10 + (C - '0');
+      if(SeenDot) --Exp10;
+    }
+  }
+  if(!NumDigits) return 0;
+  if(P != End && (*P | 0x20) == 'e') {
+    int Exp;
+    if(!(P = parseExponent(P + 1, End, Exp))) return 0;
+    Exp10 += Exp;
+  }
+
+  if(Mantissa == 0 && !Truncated) Val = 0.0;
+  else if(!Truncated && Mantissa <= (1ULL << 53) && Exp10 >= -22 && Exp10 <= 22)
+    Val = Exp10 < 0 ? Mantissa / ExactPowersOf10[-Exp10] : Mantissa * ExactPowersOf10[Exp10];
+  else Val = slowParseNumber(Start, P);
+  return P;
+}
+
+static int keywordToken(const std::string &Word) {
+  switch(Word.size()) {
+  case 2:
+    if(Word == "if") return tok_if;
+    if(Word == "in") return tok_in;
+    break;
+  case 3:
+    if(Word == "def") return tok_def;
+    if(Word == "for") return tok_for;
+    if(Word == "var") return tok_var;
+    break;
+  case 4:
+    if(Word == "then") return tok_then;
+    if(Word == "else") return tok_else;
+    if(Word == "memo") return tok_memo;
+    break;
+  case 6:
+    if(Word == "extern") return tok_extern;
+    break;
+  }
+  return tok_identifier;
+}
+
+// A lexer reads either from a stream (the interactive REPL) or from an
+// in-memory buffer, which must outlive it. Buffers are lexed in place,
+// skipping whitespace, comments and identifier and number runs a vector at
+// a time.
+class Lexer {
+public:
+  Lexer(FILE *in) : NumVal(0), In(in), Cur(0), End(0), LastChar(' '), TokStart(0) {}
+  Lexer(const char *begin, const char *end)
+    : NumVal(0), In(0), Cur(begin), End(end), LastChar(' '), TokStart(begin) {}
+
+  int gettok();
+  // Where the last token returned starts; buffers only.
+  const char *getTokStart() const { return TokStart; }
+
+  std::string IdentifierStr;
+  double NumVal;
+
+private:
+  int gettokBuffer();
+
+  FILE *In;
+  // Buffers: Cur is the next byte to lex. Streams read ahead one character
+  // into LastChar instead.
+  const char *Cur, *End;
+  int LastChar;
+  const char *TokStart;
 };
 
-static std::string IdentifierStr;
-static double NumVal;
+int Lexer::gettokBuffer() {
+  const char *P = scanClass(Cur, End, CC_Space, true);
+  while(P != End && *P == '#') {
+    P = scanClass(P + 1, End, CC_Newline, false);
+    P = scanClass(P, End, CC_Space, true);
+  }
+  TokStart = P;
+  if(P == End) {
+    Cur = P;
+    return tok_eof;
+  }
+
+  unsigned char C = *P;
+  if(CharClass[C] & CC_Alpha) {
+    Cur = scanClass(P + 1, End, CC_Alpha | CC_Digit, true);
+    IdentifierStr.assign(P, Cur);
+    return keywordToken(IdentifierStr);
+  }
+
+  if(CharClass[C] & (CC_Digit | CC_Dot)) {
+    // A literal must not run into a name or another literal, as in 1.2.3.
+    const char *E = parseNumber(P, End, NumVal);
+    if(E && (E == End || !(CharClass[(unsigned char)*E] & (CC_Alpha | CC_Digit | CC_Dot)))) {
+      Cur = E;
+      return tok_number;
+    }
+    Cur = scanClass(P + 1, End, CC_Alpha | CC_Digit | CC_Dot, true);
+    return tok_error;
+  }
+
+  Cur = P + 1;
+  return C;
+}
+
+int Lexer::gettok() {
+  if(!In) return gettokBuffer();
 
-static int gettok() {
-  static int LastChar = ' ';
-  while(isspace(LastChar)) LastChar = getchar();
+  while(inClass(LastChar, CC_Space)) LastChar = getc(In);
 
-  if(isalpha(LastChar)) {
+  if(inClass(LastChar, CC_Alpha)) {
     IdentifierStr = LastChar;
-    while(isalnum(LastChar = getchar())) IdentifierStr += LastChar;
-    if(IdentifierStr == "def") return tok_def;
-    if(IdentifierStr == "extern") return tok_extern;
-    return tok_identifier;
+    while(inClass(LastChar = getc(In), CC_Alpha | CC_Digit)) IdentifierStr += LastChar;
+    return keywordToken(IdentifierStr);
   }
 
-  if(isdigit(LastChar) || LastChar == '.') {
+  if(inClass(LastChar, CC_Digit | CC_Dot)) {
+    // The longest run that could be one literal, signs only right after
+    // an exponent marker; then it has to parse as a literal in full.
     std::string NumStr;
     do {
       NumStr += LastChar;
-      LastChar = getchar();
-    } while(isdigit(LastChar) || LastChar == '.');
+      LastChar = getc(In);
+      bool Hex = NumStr.size() > 1 && (NumStr[1] | 0x20) == 'x';
+      char Marker = NumStr.back() | 0x20;
+      if((LastChar == '+' || LastChar == '-') && Marker == (Hex ? 'p' : 'e')) {
+        NumStr += LastChar;
+        LastChar = getc(In);
+      }
+    } while(inClass(LastChar, CC_Alpha | CC_Digit | CC_Dot));
 
-    NumVal = strtod(NumStr.c_str(), 0);
-    return tok_number;
+    const char *E = parseNumber(NumStr.data(), NumStr.data() + NumStr.size(), NumVal);
+    return E == NumStr.data() + NumStr.size() ? tok_number : tok_error;
   }
 
   if(LastChar == '#') {
-    do LastChar = getchar();
+    do LastChar = getc(In);
     while(LastChar != EOF && LastChar != '\n' && LastChar != '\r');
 
     if(LastChar != EOF) return gettok();
@@ -64,219 +561,599 @@ static int gettok() {
   if(LastChar == EOF) return tok_eof;
 
   int ThisChar = LastChar;
-  LastChar = getchar();
+  LastChar = getc(In);
   return ThisChar;
 }
 
 // AST
 
+class Session;
+
 namespace {
 
 class ExprAST {
 public:
+  // For isa<> and dyn_cast<>: toy builds without RTTI, like LLVM.
+  enum ExprKind { EK_Number, EK_Variable, EK_Binary, EK_Index, EK_Call, EK_If, EK_For, EK_Var };
+
+  ExprAST(ExprKind K) : Shared(false), Kind(K) {}
   virtual ~ExprAST() {}
-  virtual Value *Codegen() = 0;
+  ExprKind getKind() const { return Kind; }
+  virtual Value *Codegen(Session &S) = 0;
+  // Codegen, reusing the value of an earlier emission of a shared node
+  // while it is still valid (see Session::SharedValues).
+  Value *CodegenShared(Session &S);
+  // Appends the direct subexpressions, for walks that must not recurse.
+  virtual void getChildren(std::vector<ExprAST*> &Out) const {}
+  // Called on a def's body: the expression's value is the def's result.
+  // Subexpressions whose value is also the result are appended to Out.
+  virtual void markTail(std::vector<ExprAST*> &Out) {}
+
+  // Set by the parser when the node stands for more than one occurrence
+  // of the same subexpression.
+  bool Shared;
+
+private:
+  const ExprKind Kind;
 };
 
 class NumberExprAST : public ExprAST {
   double Val;
 public:
-  NumberExprAST(double val) : Val(val) {}
-  virtual Value *Codegen();
+  NumberExprAST(double val) : ExprAST(EK_Number), Val(val) {}
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Number; }
+  virtual Value *Codegen(Session &S);
 };
 
 class VariableExprAST : public ExprAST {
   std::string Name;
 public:
-  VariableExprAST(const std::string &name) : Name(name) {}
-  virtual Value *Codegen();
+  VariableExprAST(const std::string &name) : ExprAST(EK_Variable), Name(name) {}
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Variable; }
+  const std::string &getName() const { return Name; }
+  virtual Value *Codegen(Session &S);
 };
 
 class BinaryExprAST : public ExprAST {
   char Op;
   ExprAST *LHS, *RHS;
+  static bool isMul(ExprAST *E);
+  bool isMulAdd() const;
+  void pushOperands(std::vector<ExprAST*> &Work) const;
+  Value *CodegenMulAdd(Session &S, Value *A, Value *B, Value *C);
+  Value *CodegenOp(Session &S, Value *L, Value *R);
+public:
+  BinaryExprAST(char op, ExprAST *lhs, ExprAST *rhs) : ExprAST(EK_Binary), Op(op), LHS(lhs), RHS(rhs) {}
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Binary; }
+  bool isArrayStore() const;
+  virtual Value *Codegen(Session &S);
+  virtual void getChildren(std::vector<ExprAST*> &Out) const { Out.push_back(LHS); Out.push_back(RHS); }
+};
+
+class IndexExprAST : public ExprAST {
+  std::string Name;
+  ExprAST *Index;
 public:
-  BinaryExprAST(char op, ExprAST *lhs, ExprAST *rhs) : Op(op), LHS(lhs), RHS(rhs) {}
-  virtual Value *Codegen();
+  IndexExprAST(const std::string &name, ExprAST *index) : ExprAST(EK_Index), Name(name), Index(index) {}
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Index; }
+  Value *CodegenAddress(Session &S);
+  virtual Value *Codegen(Session &S);
+  virtual void getChildren(std::vector<ExprAST*> &Out) const { Out.push_back(Index); }
 };
 
+bool BinaryExprAST::isArrayStore() const {
+  return Op == '=' && isa<IndexExprAST>(LHS);
+}
+
 class CallExprAST : public ExprAST {
   std::string Callee;
   std::vector<ExprAST*> Args;
+  bool IsTail;
+  Value *CodegenArrayLength(Session &S);
+  Value *CodegenSelfTailCall(Session &S, Function *F, std::vector<Value*> &ArgsV);
+public:
+  CallExprAST(const std::string &callee, std::vector<ExprAST*> &args)
+    : ExprAST(EK_Call), Callee(callee), Args(args), IsTail(false) {}
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Call; }
+  const std::string &getCallee() const { return Callee; }
+  virtual Value *Codegen(Session &S);
+  virtual void getChildren(std::vector<ExprAST*> &Out) const { Out.insert(Out.end(), Args.begin(), Args.end()); }
+  virtual void markTail(std::vector<ExprAST*> &Out) { IsTail = true; }
+};
+
+class IfExprAST : public ExprAST {
+  ExprAST *Cond, *Then, *Else;
+public:
+  IfExprAST(ExprAST *cond, ExprAST *then, ExprAST *_else) : ExprAST(EK_If), Cond(cond), Then(then), Else(_else) {}
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_If; }
+  virtual Value *Codegen(Session &S);
+  virtual void getChildren(std::vector<ExprAST*> &Out) const {
+    Out.push_back(Cond);
+    Out.push_back(Then);
+    Out.push_back(Else);
+  }
+  virtual void markTail(std::vector<ExprAST*> &Out) {
+    Out.push_back(Then);
+    Out.push_back(Else);
+  }
+};
+
+class ForExprAST : public ExprAST {
+  std::string VarName;
+  ExprAST *Start, *End, *Step, *Body;
+public:
+  ForExprAST(const std::string &varname, ExprAST *start, ExprAST *end, ExprAST *step, ExprAST *body)
+    : ExprAST(EK_For), VarName(varname), Start(start), End(end), Step(step), Body(body) {}
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_For; }
+  virtual Value *Codegen(Session &S);
+  virtual void getChildren(std::vector<ExprAST*> &Out) const {
+    Out.push_back(Start);
+    Out.push_back(End);
+    if(Step) Out.push_back(Step);
+    Out.push_back(Body);
+  }
+};
+
+class VarExprAST : public ExprAST {
+  std::vector<std::pair<std::string, ExprAST*> > VarNames;
+  ExprAST *Body;
 public:
-  CallExprAST(const std::string &callee, std::vector<ExprAST*> &args) : Callee(callee), Args(args) {}
-  virtual Value *Codegen();
+  VarExprAST(const std::vector<std::pair<std::string, ExprAST*> > &varnames, ExprAST *body)
+    : ExprAST(EK_Var), VarNames(varnames), Body(body) {}
+  static bool classof(const ExprAST *E) { return E->getKind() == EK_Var; }
+  virtual Value *Codegen(Session &S);
+  virtual void getChildren(std::vector<ExprAST*> &Out) const {
+    for(unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+      if(VarNames[i].second) Out.push_back(VarNames[i].second);
+    }
+    Out.push_back(Body);
+  }
+  virtual void markTail(std::vector<ExprAST*> &Out) { Out.push_back(Body); }
 };
 
 class PrototypeAST {
   std::string Name;
   std::vector<std::string> Args;
+  std::vector<bool> ArgIsArray;
+  bool IsExtern;
 public:
-  PrototypeAST(const std::string &name, const std::vector<std::string> &args) : Name(name), Args(args) {}
-  Function *Codegen();
+  PrototypeAST(const std::string &name, const std::vector<std::string> &args,
+               const std::vector<bool> &argIsArray = std::vector<bool>(), bool isExtern = false)
+    : Name(name), Args(args), ArgIsArray(argIsArray), IsExtern(isExtern) {
+    ArgIsArray.resize(Args.size(), false);
+  }
+  const std::string &getName() const { return Name; }
+  FunctionType *getType(Session &S);
+  Function *Codegen(Session &S);
+  void CreateArgumentAllocas(Session &S, Function *F);
 };
 
+// What a def's body may do to memory, from the AST alone.
+enum Effects { ReadsNothing, ReadsArrays, WritesMemory };
+
 class FunctionAST {
   PrototypeAST *Proto;
   ExprAST *Body;
+  bool Memo;
+  Function *CodegenMemo(Session &S, Function *F);
 public:
-  FunctionAST(PrototypeAST *proto, ExprAST *body) : Proto(proto), Body(body) {}
-  Function *Codegen();
+  FunctionAST(PrototypeAST *proto, ExprAST *body, bool memo = false) : Proto(proto), Body(body), Memo(memo) {}
+  PrototypeAST *getProto() const { return Proto; }
+  ExprAST *getBody() const { return Body; }
+  Effects analyzeEffects(Session &S) const;
+  Function *Codegen(Session &S);
 };
 
 }
 
 // Parser
 
-static int CurTok;
-static int getNextToken() {
-  return CurTok = gettok();
-}
-
-static std::map<char, int> BinopPrecedence;
+// Parse and codegen errors go to an ErrorLog. The REPL echoes them to
+// stderr; embedders can turn that off and read the last message instead.
+struct ErrorLog {
+  ErrorLog() : Echo(true), Defer(false) {}
 
-static int GetTokPrecedence() {
-  if(!isascii(CurTok)) return -1;
+  void report(const std::string &Str) {
+    if(Defer) Deferred.push_back(Str);
+    else if(Echo) fprintf(stderr, "Error: %s\n", Str.c_str());
+    Last = Str;
+  }
 
-  int TokPrec = BinopPrecedence[CurTok];
-  if(TokPrec <= 0) return -1;
-  return TokPrec;
-}
+  bool Echo;
+  // Parser threads keep their errors until they can be reported in order.
+  bool Defer;
+  std::vector<std::string> Deferred;
+  std::string Last;
+};
 
-ExprAST *Error(const char *Str) { fprintf(stderr, "Error: %s\n", Str); return 0; }
-PrototypeAST *ErrorP(const char *Str) { Error(Str); return 0; }
-FunctionAST *ErrorF(const char *Str) { Error(Str); return 0; }
-Value *ErrorV(const char *Str) { Error(Str); return 0; }
+class Parser {
+public:
+  Parser(Lexer &lex, const std::map<char, int> &binopPrecedence, ErrorLog &errors,
+         BumpPtrAllocator *arena = 0)
+    : CurTok(0), Lex(lex), BinopPrecedence(binopPrecedence), Errors(errors), Arena(arena) {}
 
+  int CurTok;
+  int getNextToken() {
+    return CurTok = Lex.gettok();
+  }
 
-static ExprAST *ParseExpression();
+  ExprAST *ParseExpression();
+  FunctionAST *ParseDefinition();
+  FunctionAST *ParseTopLevelExpr();
+  PrototypeAST *ParseExtern();
 
-static ExprAST *ParseIdentifierExpr() {
-  std::string IdName = IdentifierStr;
+private:
+  int GetTokPrecedence();
 
-  getNextToken();
+  ExprAST *Error(const char *Str) { Errors.report(Str); return 0; }
+  PrototypeAST *ErrorP(const char *Str) { Error(Str); return 0; }
 
-  if(CurTok != '(') return new VariableExprAST(IdName);
+  struct ExprFrame;
+  ExprAST *ParseNumberExpr();
+  bool ParseVarNames(ExprFrame &F);
+  PrototypeAST *ParsePrototype(bool IsExtern = false);
 
-  getNextToken();
+  // AST nodes come from Arena when there is one. Nothing frees them, so
+  // they are never destroyed either way.
+  template<typename T, typename... ArgTs> T *make(ArgTs &&... Args) {
+    if(!Arena) return new T(std::forward<ArgTs>(Args)...);
+    return new (Arena->Allocate(sizeof(T), alignof(T))) T(std::forward<ArgTs>(Args)...);
+  }
 
-  std::vector<ExprAST*> Args;
-  if(CurTok != ')') {
-    while(1) {
-      ExprAST *Arg = ParseExpression();
-      if(!Arg) return 0;
-      Args.push_back(Arg);
-      if(CurTok == ')') break;
-      if(CurTok != ',') return Error("Expected ')' or ',' in argument list");
-      getNextToken();
+  // Identical subexpressions within one expression are built once
+  // (hash-consing). A node is keyed by its kind (a token, operator or
+  // bracket), its number or name and its children; the children are
+  // unique already, so equal pointers mean equal subtrees. Loops and var
+  // expressions always write memory and are not shared.
+  struct NodeKey {
+    int Kind;
+    uint64_t Bits;
+    std::string Name;
+    std::vector<ExprAST*> Kids;
+    bool operator==(const NodeKey &K) const {
+      return Kind == K.Kind && Bits == K.Bits && Name == K.Name && Kids == K.Kids;
+    }
+  };
+  struct NodeKeyHash {
+    size_t operator()(const NodeKey &K) const {
+      return hash_combine(K.Kind, K.Bits, K.Name, hash_combine_range(K.Kids.begin(), K.Kids.end()));
     }
+  };
+  std::unordered_map<NodeKey, ExprAST*, NodeKeyHash> Interned;
+
+  template<typename T, typename... ArgTs> T *makeShared(const NodeKey &Key, ArgTs &&... Args) {
+    ExprAST *&Node = Interned[Key];
+    if(Node) Node->Shared = true;
+    else Node = make<T>(std::forward<ArgTs>(Args)...);
+    return static_cast<T*>(Node);
   }
-  getNextToken();
-  return new CallExprAST(IdName, Args);
+
+  Lexer &Lex;
+  const std::map<char, int> &BinopPrecedence;
+  ErrorLog &Errors;
+  BumpPtrAllocator *Arena;
+};
+
+int Parser::GetTokPrecedence() {
+  if(!isascii(CurTok)) return -1;
+
+  std::map<char, int>::const_iterator it = BinopPrecedence.find(CurTok);
+  if(it == BinopPrecedence.end() || it->second <= 0) return -1;
+  return it->second;
 }
 
-static ExprAST *ParseNumberExpr() {
-  ExprAST *ret = new NumberExprAST(NumVal);
+ExprAST *Parser::ParseNumberExpr() {
+  NodeKey Key = { tok_number, DoubleToBits(Lex.NumVal), "", {} };
+  ExprAST *ret = makeShared<NumberExprAST>(Key, Lex.NumVal);
   getNextToken();
   return ret;
 }
 
-static ExprAST *ParseParenExpr() {
-  getNextToken();
-  ExprAST *V = ParseExpression();
-  if(!V) return 0;
-  if(CurTok != ')') return Error("expected ')'");
-  getNextToken();
-  return V;
-}
+// Expressions are parsed without recursion, so deeply nested input costs
+// heap rather than native stack. Each construct still waiting for one of
+// its subexpressions (an open paren, call or index, an if, for or var) is
+// an ExprFrame; the binary operators of the subexpression being parsed are
+// resolved with shunting-yard operand and operator stacks. Operators of
+// equal precedence associate to the left.
+struct Parser::ExprFrame {
+  enum Kind { Top, Paren, Call, Index, If, For, Var };
+  Kind K;
+  // If: 0 cond, 1 then, 2 else. For: 0 start, 1 end, 2 step, 3 body.
+  // Var: 0 an initializer, 1 the body.
+  unsigned Stage;
+  // Where this frame's subexpression starts on the stacks.
+  size_t OperandBase, OperatorBase;
+  std::string Name;
+  std::vector<ExprAST*> Parts;
+  std::vector<std::pair<std::string, ExprAST*> > Vars;
+};
 
-static ExprAST *ParsePrimary() {
-  switch(CurTok) {
-  case tok_identifier: return ParseIdentifierExpr();
-  case tok_number: return ParseNumberExpr();
-  case '(': return ParseParenExpr();
-  default: return Error("unknown token when expecting an expression");
+// Reads 'a, b = ' or 'a, b in' after 'var' or after an initializer; leaves
+// the frame waiting for the next initializer or for the body.
+bool Parser::ParseVarNames(ExprFrame &F) {
+  while(CurTok == tok_identifier) {
+    F.Vars.push_back(std::make_pair(Lex.IdentifierStr, (ExprAST*)0));
+    getNextToken();
+    if(CurTok == '=') {
+      getNextToken();
+      return true;
+    }
+    if(CurTok != ',') break;
+    getNextToken();
+    if(CurTok != tok_identifier) {
+      Error("expected identifier list after var");
+      return false;
+    }
+  }
+  if(CurTok != tok_in) {
+    Error("expected 'in' keyword after 'var'");
+    return false;
   }
+  getNextToken();
+  F.Stage = 1;
+  return true;
 }
 
-static ExprAST *ParseBinOpRHS(int ExprPrec, ExprAST *LHS) {
+ExprAST *Parser::ParseExpression() {
+  std::vector<ExprFrame> Frames;
+  std::vector<ExprAST*> Operands;
+  std::vector<std::pair<int, int> > Operators;
+
+  auto Open = [&](ExprFrame::Kind K, const std::string &Name) {
+    ExprFrame F;
+    F.K = K;
+    F.Stage = 0;
+    F.OperandBase = Operands.size();
+    F.OperatorBase = Operators.size();
+    F.Name = Name;
+    Frames.push_back(F);
+  };
+  auto Reduce = [&]() {
+    ExprAST *RHS = Operands.back();
+    Operands.pop_back();
+    ExprAST *LHS = Operands.back();
+    int Op = Operators.back().first;
+    NodeKey Key = { Op, 0, "", { LHS, RHS } };
+    Operands.back() = makeShared<BinaryExprAST>(Key, Op, LHS, RHS);
+    Operators.pop_back();
+  };
+
+  Interned.clear();
+  Open(ExprFrame::Top, "");
   while(1) {
-    int TokPrec = GetTokPrecedence();
-    if(TokPrec < ExprPrec) return LHS;
+    // An operand, or the start of a construct whose first subexpression
+    // comes next.
+    ExprAST *Operand = 0;
+    switch(CurTok) {
+    case tok_identifier: {
+      std::string IdName = Lex.IdentifierStr;
+      getNextToken();
+      if(CurTok == '[') {
+        getNextToken();
+        Open(ExprFrame::Index, IdName);
+        continue;
+      }
+      if(CurTok != '(') {
+        NodeKey Key = { tok_identifier, 0, IdName, {} };
+        Operand = makeShared<VariableExprAST>(Key, IdName);
+        break;
+      }
+      getNextToken();
+      if(CurTok != ')') {
+        Open(ExprFrame::Call, IdName);
+        continue;
+      }
+      getNextToken();
+      std::vector<ExprAST*> NoArgs;
+      NodeKey Key = { '(', 0, IdName, NoArgs };
+      Operand = makeShared<CallExprAST>(Key, IdName, NoArgs);
+      break;
+    }
+    case tok_number:
+      Operand = ParseNumberExpr();
+      break;
+    case '(':
+      getNextToken();
+      Open(ExprFrame::Paren, "");
+      continue;
+    case tok_if:
+      getNextToken();
+      Open(ExprFrame::If, "");
+      continue;
+    case tok_for:
+      getNextToken();
+      if(CurTok != tok_identifier) return Error("expected identifier after for");
+      Open(ExprFrame::For, Lex.IdentifierStr);
+      getNextToken();
+      if(CurTok != '=') return Error("expected '=' after for");
+      getNextToken();
+      continue;
+    case tok_var:
+      getNextToken();
+      if(CurTok != tok_identifier) return Error("expected identifier after var");
+      Open(ExprFrame::Var, "");
+      if(!ParseVarNames(Frames.back())) return 0;
+      continue;
+    case tok_error: return Error("malformed number literal");
+    default: return Error("unknown token when expecting an expression");
+    }
+    Operands.push_back(Operand);
 
-    int BinOp = CurTok;
-    getNextToken();
+    // Binary operators, and the frames that end here, until another
+    // operand is needed.
+    while(1) {
+      int Prec = GetTokPrecedence();
+      if(Prec > 0) {
+        while(Operators.size() > Frames.back().OperatorBase && Operators.back().second >= Prec) Reduce();
+        Operators.push_back(std::make_pair(CurTok, Prec));
+        getNextToken();
+        break;
+      }
 
-    ExprAST *RHS = ParsePrimary();
-    if(!RHS) return 0;
+      ExprFrame &F = Frames.back();
+      while(Operators.size() > F.OperatorBase) Reduce();
+      ExprAST *E = Operands.back();
+      Operands.pop_back();
+
+      bool NextPart = false;
+      switch(F.K) {
+      case ExprFrame::Top:
+        return E;
+      case ExprFrame::Paren:
+        if(CurTok != ')') return Error("expected ')'");
+        getNextToken();
+        Operand = E;
+        break;
+      case ExprFrame::Index:
+        if(CurTok != ']') return Error("Expected ']' after array index");
+        getNextToken();
+        {
+          NodeKey Key = { '[', 0, F.Name, { E } };
+          Operand = makeShared<IndexExprAST>(Key, F.Name, E);
+        }
+        break;
+      case ExprFrame::Call:
+        F.Parts.push_back(E);
+        if(CurTok == ',') {
+          getNextToken();
+          NextPart = true;
+          break;
+        }
+        if(CurTok != ')') return Error("Expected ')' or ',' in argument list");
+        getNextToken();
+        {
+          NodeKey Key = { '(', 0, F.Name, F.Parts };
+          Operand = makeShared<CallExprAST>(Key, F.Name, F.Parts);
+        }
+        break;
+      case ExprFrame::If:
+        F.Parts.push_back(E);
+        if(F.Stage == 2) {
+          NodeKey Key = { tok_if, 0, "", F.Parts };
+          Operand = makeShared<IfExprAST>(Key, F.Parts[0], F.Parts[1], F.Parts[2]);
+          break;
+        }
+        if(CurTok != (F.Stage == 0 ? tok_then : tok_else)) {
+          return Error(F.Stage == 0 ? "expected then" : "expected else");
+        }
+        getNextToken();
+        ++F.Stage;
+        NextPart = true;
+        break;
+      case ExprFrame::For:
+        F.Parts.push_back(E);
+        if(F.Stage == 3) {
+          ExprAST *Step = F.Parts.size() == 4 ? F.Parts[2] : 0;
+          Operand = make<ForExprAST>(F.Name, F.Parts[0], F.Parts[1], Step, F.Parts.back());
+          break;
+        }
+        if(F.Stage == 0) {
+          if(CurTok != ',') return Error("expected ',' after for start value");
+          F.Stage = 1;
+        } else if(F.Stage == 1 && CurTok == ',') {
+          F.Stage = 2;
+        } else {
+          if(CurTok != tok_in) return Error("expected 'in' after for");
+          F.Stage = 3;
+        }
+        getNextToken();
+        NextPart = true;
+        break;
+      case ExprFrame::Var:
+        if(F.Stage == 1) {
+          Operand = make<VarExprAST>(F.Vars, E);
+          break;
+        }
+        F.Vars.back().second = E;
+        if(CurTok == ',') {
+          getNextToken();
+          if(CurTok != tok_identifier) return Error("expected identifier list after var");
+        } else if(CurTok != tok_in) {
+          return Error("expected 'in' keyword after 'var'");
+        }
+        if(!ParseVarNames(F)) return 0;
+        NextPart = true;
+        break;
+      }
+      if(NextPart) break;
 
-    int NextPrec = GetTokPrecedence();
-    if(TokPrec < NextPrec) {
-      RHS = ParseBinOpRHS(TokPrec + 1, RHS);
-      if(!RHS) return 0;
+      Frames.pop_back();
+      Operands.push_back(Operand);
     }
-
-    LHS = new BinaryExprAST(BinOp, LHS, RHS);
   }
 }
 
-static ExprAST *ParseExpression() {
-  ExprAST *LHS = ParsePrimary();
-  if(!LHS) return 0;
-  return ParseBinOpRHS(0, LHS);
-}
-
-static PrototypeAST *ParsePrototype() {
+PrototypeAST *Parser::ParsePrototype(bool IsExtern) {
   if(CurTok != tok_identifier) return ErrorP("Expected function name in prototype");
 
-  std::string FnName = IdentifierStr;
+  std::string FnName = Lex.IdentifierStr;
 
   getNextToken();
 
   if(CurTok != '(') return ErrorP("Expected '(' in prototype");
 
   std::vector<std::string> ArgNames;
+  std::vector<bool> ArgIsArray;
+
+  getNextToken();
+  while(CurTok == tok_identifier) {
+    ArgNames.push_back(Lex.IdentifierStr);
+    getNextToken();
 
-  while(getNextToken() == tok_identifier) {
-    ArgNames.push_back(IdentifierStr);
+    bool IsArray = false;
+    if(CurTok == '[') {
+      if(getNextToken() != ']') return ErrorP("Expected ']' in array parameter");
+      getNextToken();
+      IsArray = true;
+    }
+    ArgIsArray.push_back(IsArray);
   }
   if(CurTok != ')') return ErrorP("Expected ')' in prototype");
 
   getNextToken();
 
-  return new PrototypeAST(FnName, ArgNames);
+  return make<PrototypeAST>(FnName, ArgNames, ArgIsArray, IsExtern);
 }
 
-static FunctionAST *ParseDefinition() {
+/// definition ::= 'memo'? 'def' prototype expression
+FunctionAST *Parser::ParseDefinition() {
+  bool Memo = CurTok == tok_memo;
+  if(Memo && getNextToken() != tok_def) {
+    Error("Expected 'def' after 'memo'");
+    return 0;
+  }
   getNextToken();
   PrototypeAST *Proto = ParsePrototype();
   if(Proto == 0) return 0;
 
   if(ExprAST *E = ParseExpression()) {
-    return new FunctionAST(Proto, E);
+    return make<FunctionAST>(Proto, E, Memo);
   }
   return 0;
 }
 
-static FunctionAST *ParseTopLevelExpr() {
+FunctionAST *Parser::ParseTopLevelExpr() {
   if(ExprAST *E = ParseExpression()) {
-    PrototypeAST *Proto = new PrototypeAST("", std::vector<std::string>());
-    return new FunctionAST(Proto, E);
+    PrototypeAST *Proto = make<PrototypeAST>("", std::vector<std::string>());
+    return make<FunctionAST>(Proto, E);
   }
   return 0;
 }
 
-static PrototypeAST *ParseExtern() {
+PrototypeAST *Parser::ParseExtern() {
   getNextToken();
-  return ParsePrototype();
+  return ParsePrototype(true);
 }
 
 // MCJIT helper
 
+// Shared by all sessions, so names stay unique process-wide. A restored
+// snapshot moves it past the names it already uses.
+static std::atomic<int> NextUniqueId(0);
+
 std::string GenerateUniqueName(const char *root) {
-  static int i = 0;
-  char s[16];
-  sprintf(s, "%s%d", root, i++);
+  char s[32];
+  snprintf(s, sizeof(s), "%s%d", root, NextUniqueId++);
   std::string S = s;
   return S;
 }
@@ -304,27 +1181,160 @@ std::string MakeLegalFunctionName(std::string Name) {
   return NewName;
 }
 
+// Points globals referenced from another module at declarations in M.
+static void MapGlobalsInto(Value *V, Module *M, ValueToValueMapTy &VMap) {
+  if(Function *G = dyn_cast<Function>(V)) {
+    if(!VMap.count(G)) VMap[G] = M->getOrInsertFunction(G->getName(), G->getFunctionType());
+  } else if(GlobalVariable *GV = dyn_cast<GlobalVariable>(V)) {
+    if(!VMap.count(GV)) VMap[GV] = M->getOrInsertGlobal(GV->getName(), GV->getType()->getElementType());
+  } else if(ConstantExpr *CE = dyn_cast<ConstantExpr>(V)) {
+    for(User::op_iterator OI = CE->op_begin(), OE = CE->op_end(); OI != OE; ++OI) {
+      MapGlobalsInto(*OI, M, VMap);
+    }
+  }
+}
+
+// Copies F's body into M as a new function, declaring in M whatever F
+// refers to unless F already lives there.
+static Function *CloneDefinitionInto(Function *F, Module *M, const Twine &Name,
+                                     GlobalValue::LinkageTypes Linkage) {
+  Function *NewF = Function::Create(F->getFunctionType(), Linkage, Name, M);
+  ValueToValueMapTy VMap;
+  Function::arg_iterator DestI = NewF->arg_begin();
+  for(Function::const_arg_iterator AI = F->arg_begin(); AI != F->arg_end(); ++AI, ++DestI) {
+    DestI->setName(AI->getName());
+    VMap[AI] = DestI;
+  }
+  if(F->getParent() != M) {
+    for(inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+      for(User::op_iterator OI = I->op_begin(), OE = I->op_end(); OI != OE; ++OI) {
+        MapGlobalsInto(*OI, M, VMap);
+      }
+    }
+  }
+  SmallVector<ReturnInst*, 4> Returns;
+  CloneFunctionInto(NewF, F, VMap, true, Returns);
+  return NewF;
+}
+
+// Host view of a Kaleidoscope array: a borrowed pointer plus length, laid
+// out like the IR type %karray = { double*, i64 }. JITed functions take
+// array parameters as KArray*, so host buffers are used without copying.
+struct KArray {
+  double *Data;
+  int64_t Len;
+};
+
+// The optimized bitcode and object code of each compiled module, kept so
+// that snapshot() can save them. Restored modules point into the mapped
+// snapshot, and MCJIT gets their objects back from here instead of
+// running codegen again.
+class ModuleImageCache : public ObjectCache {
+public:
+  ModuleImageCache() : Recording(false), ObjectBytes(0) {}
+
+  virtual void notifyObjectCompiled(const Module *M, const MemoryBuffer *Obj) override {
+    ObjectBytes += Obj->getBufferSize();
+    if(!Recording) return;
+    Storage.push_back(Obj->getBuffer().str());
+    Images[M].second = Storage.back();
+  }
+
+  virtual MemoryBuffer *getObject(const Module *M) override {
+    std::map<const Module *, std::pair<StringRef, StringRef> >::iterator it = Images.find(M);
+    if(it == Images.end() || it->second.second.empty()) return NULL;
+    return MemoryBuffer::getMemBuffer(it->second.second, M->getModuleIdentifier(), false);
+  }
+
+  void recordBitcode(const Module *M) {
+    if(!Recording) return;
+    Storage.push_back(std::string());
+    raw_string_ostream OS(Storage.back());
+    WriteBitcodeToFile(M, OS);
+    OS.flush();
+    Images[M].first = Storage.back();
+  }
+
+  bool Recording;
+  size_t ObjectBytes;
+  // Bitcode and object of each module.
+  std::map<const Module *, std::pair<StringRef, StringRef> > Images;
+
+private:
+  std::deque<std::string> Storage;
+};
+
 class MCJITHelper {
 public:
-  MCJITHelper(LLVMContext &C) : Context(C), OpenModule(NULL) {}
+  MCJITHelper(LLVMContext &C, ErrorLog &Errors);
   ~MCJITHelper();
 
   Function *getFunction(const std::string FnName);
+  bool hasFunction(const std::string &FnName) const;
+  Function *getDefinition(const std::string &FnName);
   Module *getModuleForNewFunction();
   void *getPointerToFunction(Function *F);
+  void compilePending();
+  bool discard(Module *M);
   void *getSymbolAddress(const std::string &Name);
+  void addBuiltin(const std::string &Name, void *Addr);
+  void bindArray(const std::string &Name, double *Data, int64_t Len);
+  void shareArray(const std::string &Name, KArray *A);
+  bool isBoundArray(const std::string &Name) const;
+  void fillSlotOnCompile(const std::string &FnName, std::atomic<void *> *Slot);
+  uint64_t resolveSymbol(const std::string &Name);
+  void reportError(const std::string &Str) { Errors.report(Str); }
+  size_t getObjectBytes() const { return Images.ObjectBytes; }
   void dump();
+  bool snapshot(const std::string &Path);
+  bool restore(const std::string &Path);
+  bool emitPrelude(const std::string &Path);
 
 private:
   typedef std::vector<Module *> ModuleVector;
   typedef std::vector<ExecutionEngine *> EngineVector;
 
+  bool resolveExternals(Module *M, std::vector<GlobalValue *> *Unresolved = 0);
+  void dropUnresolved(Function *F, std::vector<GlobalValue *> &Unresolved);
+  ExecutionEngine *createEngine(Module *M);
+  ExecutionEngine *compileOpenModule();
+  Function *importFromPrelude(const std::string &FnName);
+  std::string getTargetName() const;
+
   LLVMContext &Context;
+  ErrorLog &Errors;
+  std::string TargetCPU;
+  std::vector<std::string> TargetAttrs;
   Module *OpenModule;
   ModuleVector Modules;
   EngineVector Engines;
+  StringMap<uint64_t> SymbolCache;
+  StringMap<KArray *> BoundArrays;
+  ModuleImageCache Images;
+  std::vector<std::unique_ptr<MemoryBuffer> > Snapshots;
+  ModuleVector Preludes;
+  StringMap<KArray *> SharedArrays;
+  std::vector<std::pair<std::string, std::atomic<void *> *> > PendingSlots;
 };
 
+// Prelude files are read once per process. Modules belong to a context,
+// so each session still parses its own copy, lazily.
+static const std::vector<std::unique_ptr<MemoryBuffer> > &getPreludeFiles() {
+  static std::vector<std::unique_ptr<MemoryBuffer> > Files;
+  static std::once_flag Once;
+  std::call_once(Once, [] {
+    for(unsigned i = 0, e = Preludes.size(); i != e; ++i) {
+      ErrorOr<std::unique_ptr<MemoryBuffer> > File = MemoryBuffer::getFile(Preludes[i], -1, false);
+      if(!File) {
+        fprintf(stderr, "Cannot read prelude '%s': %s\n", Preludes[i].c_str(), File.getError().message().c_str());
+        continue;
+      }
+      Files.push_back(std::move(*File));
+    }
+  });
+  return Files;
+}
+
 class HelpingMemoryManager : public SectionMemoryManager {
   HelpingMemoryManager(const HelpingMemoryManager &) = delete;
   void operator=(const HelpingMemoryManager &) = delete;
@@ -341,15 +1351,49 @@ private:
 };
 
 uint64_t HelpingMemoryManager::getSymbolAddress(const std::string &Name) {
-  uint64_t pfn = RTDyldMemoryManager::getSymbolAddress(Name);
+  uint64_t pfn = MasterHelper->resolveSymbol(Name);
   if(pfn) return pfn;
 
-  pfn = (uint64_t)MasterHelper->getSymbolAddress(Name);
-  if(!pfn) report_fatal_error("Program used extern function '" + Name + "' which could not be resolved!");
+  // Platform special cases (e.g. the libc_nonshared stat family) that a
+  // plain dlsym search does not find.
+  pfn = RTDyldMemoryManager::getSymbolAddress(Name);
+  if(!pfn) MasterHelper->reportError("Program used extern function '" + Name + "' which could not be resolved!");
 
   return pfn;
 }
 
+// Without an explicit cpu, EngineBuilder targets a generic x86-64 and the
+// JITed code never uses AVX2/FMA. -mcpu pins the cpu for reproducible code.
+MCJITHelper::MCJITHelper(LLVMContext &C, ErrorLog &E) : Context(C), Errors(E), OpenModule(NULL) {
+  if(MCPU.empty()) {
+    TargetCPU = sys::getHostCPUName();
+
+    StringMap<bool> HostFeatures;
+    if(sys::getHostCPUFeatures(HostFeatures)) {
+      for(StringMap<bool>::iterator it = HostFeatures.begin(); it != HostFeatures.end(); ++it) {
+        TargetAttrs.push_back((it->getValue() ? "+" : "-") + it->getKey().str());
+      }
+    }
+  } else {
+    TargetCPU = MCPU;
+  }
+
+  TargetAttrs.insert(TargetAttrs.end(), MAttrs.begin(), MAttrs.end());
+  Images.Recording = !SnapshotPath.empty();
+
+  const std::vector<std::unique_ptr<MemoryBuffer> > &Files = getPreludeFiles();
+  for(unsigned i = 0, e = Files.size(); i != e; ++i) {
+    MemoryBuffer *Buffer = MemoryBuffer::getMemBuffer(Files[i]->getBuffer(), Files[i]->getBufferIdentifier(), false);
+    ErrorOr<Module *> M = getLazyBitcodeModule(Buffer, Context);
+    if(!M) {
+      delete Buffer;
+      Errors.report("Cannot load prelude '" + Files[i]->getBufferIdentifier().str() + "': " + M.getError().message());
+      continue;
+    }
+    Preludes.push_back(*M);
+  }
+}
+
 MCJITHelper::~MCJITHelper() {
   if(OpenModule) delete OpenModule;
   EngineVector::iterator begin = Engines.begin();
@@ -357,6 +1401,10 @@ MCJITHelper::~MCJITHelper() {
   EngineVector::iterator it;
   for(it = begin; it != end; ++it) delete *it;
 
+  for(StringMap<KArray *>::iterator AI = BoundArrays.begin(); AI != BoundArrays.end(); ++AI) {
+    delete AI->getValue();
+  }
+  for(ModuleVector::iterator it = Preludes.begin(); it != Preludes.end(); ++it) delete *it;
 }
 
 Function *MCJITHelper::getFunction(const std::string FnName) {
@@ -367,21 +1415,87 @@ Function *MCJITHelper::getFunction(const std::string FnName) {
     Function *F = (*it)->getFunction(FnName);
     if(F) {
       if(*it == OpenModule) return F;
+      // Prelude copies and batch rows are private to their module.
+      if(F->hasLocalLinkage()) continue;
 
       assert(OpenModule != NULL);
 
       Function *PF = OpenModule->getFunction(FnName);
       if(PF && !PF->empty()) {
-        ErrorF("redefinition of function across modules");
+        Errors.report("redefinition of function across modules");
         return 0;
       }
 
+      // The definition's module has been compiled, so its attributes are
+      // final; without them every cross-module call is opaque to GVN/LICM.
       if(!PF) PF = Function::Create(F->getFunctionType(), Function::ExternalLinkage, FnName, OpenModule);
+      PF->setAttributes(F->getAttributes());
 
       return PF;
 
     }
   }
+  return importFromPrelude(FnName);
+}
+
+// Whether getFunction would find FnName, without declaring or importing
+// anything into the open module.
+bool MCJITHelper::hasFunction(const std::string &FnName) const {
+  for(ModuleVector::const_iterator it = Modules.begin(); it != Modules.end(); ++it) {
+    Function *F = (*it)->getFunction(FnName);
+    if(F && (*it == OpenModule || !F->hasLocalLinkage())) return true;
+  }
+  for(ModuleVector::const_iterator it = Preludes.begin(); it != Preludes.end(); ++it) {
+    Function *F = (*it)->getFunction(FnName);
+    if(F && !F->isDeclaration()) return true;
+  }
+  return false;
+}
+
+// Gives the open module its own internal copy of a prelude function, and
+// of the prelude functions that one calls, so the inliner can see through
+// them. Returns NULL when no prelude defines FnName.
+Function *MCJITHelper::importFromPrelude(const std::string &FnName) {
+  Function *PF = NULL;
+  for(ModuleVector::iterator it = Preludes.begin(); it != Preludes.end() && !PF; ++it) {
+    PF = (*it)->getFunction(FnName);
+    if(PF && PF->isDeclaration()) PF = NULL;
+  }
+  if(!PF) return NULL;
+
+  std::string ErrStr;
+  if(PF->Materialize(&ErrStr)) {
+    Errors.report("Cannot load '" + FnName + "' from prelude: " + ErrStr);
+    return NULL;
+  }
+
+  Module *M = getModuleForNewFunction();
+  Function *Decl = M->getFunction(FnName);
+  if(Decl && !Decl->isDeclaration()) return Decl;
+
+  Function *F = CloneDefinitionInto(PF, M, "", Function::InternalLinkage);
+  // Earlier uses, and recursive calls in the copy, went to a declaration.
+  if((Decl = M->getFunction(FnName))) {
+    Decl->replaceAllUsesWith(F);
+    F->takeName(Decl);
+    Decl->eraseFromParent();
+  } else {
+    F->setName(FnName);
+  }
+
+  for(inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+    CallInst *Call = dyn_cast<CallInst>(&*I);
+    Function *Callee = Call ? Call->getCalledFunction() : NULL;
+    if(Callee && Callee->isDeclaration() && !Callee->isIntrinsic()) importFromPrelude(Callee->getName().str());
+  }
+  return F;
+}
+
+Function *MCJITHelper::getDefinition(const std::string &FnName) {
+  for(ModuleVector::iterator it = Modules.begin(); it != Modules.end(); ++it) {
+    Function *F = (*it)->getFunction(FnName);
+    if(F && !F->isDeclaration()) return F;
+  }
   return NULL;
 }
 
@@ -404,45 +1518,144 @@ void *MCJITHelper::getPointerToFunction(Function *F) {
   }
 
   if(OpenModule) {
-    std::string ErrStr;
-    ExecutionEngine *NewEngine =
-      EngineBuilder(OpenModule)
-        .setErrorStr(&ErrStr)
-        .setMCJITMemoryManager(
-          new HelpingMemoryManager(this))
-        .create();
-    if(!NewEngine) {
-      fprintf(stderr, "Could not create ExecutionEngine: %s\n", ErrStr.c_str());
-      exit(1);
-    }
-
-    auto *FPM = new legacy::FunctionPassManager(OpenModule);
-
-    OpenModule->setDataLayout(NewEngine->getDataLayout());
-    FPM->add(createBasicAliasAnalysisPass());
-    FPM->add(createPromoteMemoryToRegisterPass());
-    FPM->add(createInstructionCombiningPass());
-    FPM->add(createReassociatePass());
-    FPM->add(createGVNPass());
-    FPM->add(createCFGSimplificationPass());
-    FPM->doInitialization();
-
-    Module::iterator it;
-    Module::iterator end = OpenModule->end();
-    for(it = OpenModule->begin(); it != end; ++it) {
-      FPM->run(*it);
-    }
-
-    delete FPM;
-
-    OpenModule = NULL;
-    Engines.push_back(NewEngine);
-    NewEngine->finalizeObject();
-    return NewEngine->getPointerToFunction(F);
+    // Drop the offending expression but keep the module open, so the
+    // definitions already in it are not lost.
+    std::vector<GlobalValue *> Unresolved;
+    if(!resolveExternals(OpenModule, &Unresolved)) {
+      dropUnresolved(F, Unresolved);
+      return NULL;
+    }
+
+    return compileOpenModule()->getPointerToFunction(F);
   }
   return NULL;
 }
 
+// Compiles what the open module holds, so that code generated next goes to
+// a module of its own.
+void MCJITHelper::compilePending() {
+  if(OpenModule && !OpenModule->empty() && resolveExternals(OpenModule)) compileOpenModule();
+}
+
+// Frees the machine code and IR of a compiled module whose only external
+// definitions are top-level expressions, which must not run again.
+bool MCJITHelper::discard(Module *M) {
+  for(Module::iterator FI = M->begin(), FE = M->end(); FI != FE; ++FI) {
+    if(FI->isDeclaration() || FI->hasLocalLinkage()) continue;
+    if(!FI->getName().startswith("anon_func_") && !FI->getName().endswith(".entry")) return false;
+  }
+  for(EngineVector::iterator it = Engines.begin(); it != Engines.end(); ++it) {
+    if(!(*it)->removeModule(M)) continue;
+    delete *it;
+    Engines.erase(it);
+    Modules.erase(std::find(Modules.begin(), Modules.end(), M));
+    Images.Images.erase(M);
+    delete M;
+    return true;
+  }
+  return false;
+}
+
+ExecutionEngine *MCJITHelper::createEngine(Module *M) {
+  TargetOptions Opts;
+  Opts.AllowFPOpFusion = getFPContractMode();
+  Opts.UnsafeFPMath = FastMath;
+  Opts.NoNaNsFPMath = FastMath || NoHonorNaNs;
+  Opts.NoInfsFPMath = FastMath || NoHonorInfs;
+
+  std::string ErrStr;
+  ExecutionEngine *NewEngine =
+    EngineBuilder(M)
+      .setErrorStr(&ErrStr)
+      .setMCPU(TargetCPU)
+      .setMAttrs(TargetAttrs)
+      .setTargetOptions(Opts)
+      .setMCJITMemoryManager(
+        new HelpingMemoryManager(this))
+      .create();
+  if(!NewEngine) {
+    fprintf(stderr, "Could not create ExecutionEngine: %s\n", ErrStr.c_str());
+    exit(1);
+  }
+  NewEngine->setObjectCache(&Images);
+  return NewEngine;
+}
+
+ExecutionEngine *MCJITHelper::compileOpenModule() {
+  ExecutionEngine *NewEngine = createEngine(OpenModule);
+
+  // Interprocedural passes, run over the module's call graph callees
+  // first: infer nounwind, readnone and readonly for whole SCCs, which
+  // codegen's per-def analysis cannot see through mutual recursion. Prelude
+  // and tier 2 callee copies are internal; inline them into their callers
+  // and drop those left unused.
+  bool HasInternal = false;
+  for(Module::iterator it = OpenModule->begin(), end = OpenModule->end(); it != end; ++it) {
+    HasInternal |= it->hasLocalLinkage();
+  }
+  legacy::PassManager MPM;
+  MPM.add(createBasicAliasAnalysisPass());
+  MPM.add(createPruneEHPass());
+  MPM.add(createFunctionAttrsPass());
+  if(HasInternal) {
+    MPM.add(createFunctionInliningPass());
+    MPM.add(createGlobalDCEPass());
+  }
+  MPM.run(*OpenModule);
+
+  // Internal functions left after inlining are only called from this
+  // module, so they can use the faster calling convention.
+  for(Module::iterator it = OpenModule->begin(), end = OpenModule->end(); it != end; ++it) {
+    if(!it->hasLocalLinkage() || it->isDeclaration() || it->hasAddressTaken()) continue;
+    it->setCallingConv(CallingConv::Fast);
+    for(User *U : it->users()) cast<CallInst>(U)->setCallingConv(CallingConv::Fast);
+  }
+
+  auto *FPM = new legacy::FunctionPassManager(OpenModule);
+
+  OpenModule->setDataLayout(NewEngine->getDataLayout());
+  // Target cost model for the vectorizer, sized to the -mcpu vector width.
+  NewEngine->getTargetMachine()->addAnalysisPasses(*FPM);
+  FPM->add(createBasicAliasAnalysisPass());
+  FPM->add(createPromoteMemoryToRegisterPass());
+  FPM->add(createInstructionCombiningPass());
+  // Catches what codegen leaves, e.g. n * f(n - 1) via an accumulator.
+  FPM->add(createTailCallEliminationPass());
+  FPM->add(createReassociatePass());
+  FPM->add(createGVNPass());
+  FPM->add(createCFGSimplificationPass());
+  FPM->add(createIndVarSimplifyPass());
+  FPM->add(createLICMPass());
+  FPM->add(createLoopVectorizePass());
+  FPM->add(createLoopUnrollPass());
+  FPM->add(createInstructionCombiningPass());
+  FPM->add(createCFGSimplificationPass());
+  FPM->doInitialization();
+
+  Module::iterator it;
+  Module::iterator end = OpenModule->end();
+  for(it = OpenModule->begin(); it != end; ++it) {
+    FPM->run(*it);
+  }
+
+  delete FPM;
+
+  Images.recordBitcode(OpenModule);
+  OpenModule = NULL;
+  Engines.push_back(NewEngine);
+  NewEngine->finalizeObject();
+
+  for(unsigned i = 0; i != PendingSlots.size();) {
+    if(uint64_t Addr = NewEngine->getFunctionAddress(PendingSlots[i].first)) {
+      PendingSlots[i].second->store((void *)Addr, std::memory_order_release);
+      PendingSlots.erase(PendingSlots.begin() + i);
+    } else {
+      ++i;
+    }
+  }
+  return NewEngine;
+}
+
 void *MCJITHelper::getSymbolAddress(const std::string &Name) {
   EngineVector::iterator begin = Engines.begin();
   EngineVector::iterator end = Engines.end();
@@ -454,188 +1667,2746 @@ void *MCJITHelper::getSymbolAddress(const std::string &Name) {
   return NULL;
 }
 
-void MCJITHelper::dump() {
-  for(auto it = Modules.begin(); it != Modules.end(); ++it) {
-      (*it)->dump();
+void MCJITHelper::addBuiltin(const std::string &Name, void *Addr) {
+  SymbolCache[Name] = (uint64_t)Addr;
+}
+
+// Makes the host buffer visible to Kaleidoscope code as the global array
+// 'Name'. The descriptor has a stable address, so rebinding a name to a new
+// buffer takes effect in already compiled code.
+void MCJITHelper::bindArray(const std::string &Name, double *Data, int64_t Len) {
+  KArray *&A = BoundArrays[Name];
+  if(!A) {
+    A = new KArray();
+    addBuiltin(Name, A);
   }
+  A->Data = Data;
+  A->Len = Len;
 }
 
-// Code Generation
+// Binds Name to a descriptor owned by another session, so rebinding
+// there is seen here too.
+void MCJITHelper::shareArray(const std::string &Name, KArray *A) {
+  SharedArrays[Name] = A;
+  addBuiltin(Name, A);
+}
 
-//static Module *TheModule;
-static MCJITHelper *JITHelper;
-static IRBuilder<> Builder(getGlobalContext());
-static std::map<std::string, Value*> NamedValues;
+bool MCJITHelper::isBoundArray(const std::string &Name) const {
+  return BoundArrays.count(Name) || SharedArrays.count(Name);
+}
 
-Value *NumberExprAST::Codegen() {
-  return ConstantFP::get(getGlobalContext(), APFloat(Val));
+// Stores FnName's address in Slot once the module defining it is compiled.
+void MCJITHelper::fillSlotOnCompile(const std::string &FnName, std::atomic<void *> *Slot) {
+  PendingSlots.push_back(std::make_pair(FnName, Slot));
 }
 
+// Resolved addresses never change once found: functions cannot be
+// redefined, and builtins are registered before any module is compiled.
+// Misses are not cached so that a later def can still satisfy them.
+uint64_t MCJITHelper::resolveSymbol(const std::string &Name) {
+  StringMap<uint64_t>::iterator it = SymbolCache.find(Name);
+  if(it != SymbolCache.end()) return it->second;
+
+  uint64_t pfn = (uint64_t)sys::DynamicLibrary::SearchForAddressOfSymbol(Name);
+  if(!pfn) pfn = (uint64_t)getSymbolAddress(Name);
+  if(pfn) SymbolCache[Name] = pfn;
 
-Value *VariableExprAST::Codegen() {
-  Value *V = NamedValues[Name];
-  return V ? V : ErrorV("Unknown variable name");
+  return pfn;
 }
 
-Value *BinaryExprAST::Codegen() {
-  Value *L = LHS->Codegen();
-  Value *R = RHS->Codegen();
-  if(L == 0 || R == 0) return 0;
-  switch(Op) {
-  case '+' : return Builder.CreateFAdd(L, R, "addtmp");
-  case '-' : return Builder.CreateFSub(L, R, "subtmp");
-  case '*' : return Builder.CreateFMul(L, R, "multmp");
-  case '<' :
-    L = Builder.CreateFCmpULT(L, R, "cmptmp");
-    return Builder.CreateUIToFP(L, Type::getDoubleTy(getGlobalContext()), "booltmp");
-  default : return ErrorV("invalid binary operator");
+// Checks every extern the module actually calls before handing it to MCJIT,
+// which would otherwise abort the process on the first unresolved relocation.
+bool MCJITHelper::resolveExternals(Module *M, std::vector<GlobalValue *> *Unresolved) {
+  bool Resolved = true;
+  for(Module::iterator it = M->begin(), end = M->end(); it != end; ++it) {
+    if(!it->isDeclaration() || it->isIntrinsic() || it->use_empty()) continue;
+    if(resolveSymbol(it->getName().str())) continue;
+    Errors.report("Program used extern function '" + it->getName().str() + "' which could not be resolved!");
+    if(Unresolved) Unresolved->push_back(&*it);
+    Resolved = false;
+  }
+  for(Module::global_iterator it = M->global_begin(), end = M->global_end(); it != end; ++it) {
+    if(!it->isDeclaration() || it->use_empty()) continue;
+    if(resolveSymbol(it->getName().str())) continue;
+    Errors.report("Program used array '" + it->getName().str() + "' which is not bound!");
+    if(Unresolved) Unresolved->push_back(&*it);
+    Resolved = false;
   }
+  return Resolved;
 }
 
-Value *CallExprAST::Codegen() {
-  Function *CalleeF = JITHelper->getFunction(Callee);
-  if(CalleeF == 0) return ErrorV("Unknown function referenced");
+// Deletes F, and every function of the open module that reaches one of
+// the Unresolved symbols through calls within the module, so the next
+// expression can compile the rest. Dropped defs are reported by name.
+void MCJITHelper::dropUnresolved(Function *F, std::vector<GlobalValue *> &Unresolved) {
+  std::set<Function *> Dropped;
+  Dropped.insert(F);
+  std::vector<GlobalValue *> Work(Unresolved);
+  while(!Work.empty()) {
+    GlobalValue *GV = Work.back();
+    Work.pop_back();
+    for(User *U : GV->users()) {
+      Instruction *I = dyn_cast<Instruction>(U);
+      if(!I) continue;
+      Function *Caller = I->getParent()->getParent();
+      if(Dropped.insert(Caller).second) Work.push_back(Caller);
+    }
+  }
 
-  if(CalleeF->arg_size() != Args.size()) return ErrorV("Incorrect # arguments passed");
+  // Bodies go first, as dropped functions may call each other.
+  for(std::set<Function *>::iterator it = Dropped.begin(); it != Dropped.end(); ++it) {
+    Function *D = *it;
+    if(D != F && !D->hasLocalLinkage() && !D->getName().startswith("anon_func_")) {
+      Errors.report("Dropped def '" + D->getName().str() + "', which uses an unresolved symbol");
+    }
+    D->deleteBody();
+  }
+  for(std::set<Function *>::iterator it = Dropped.begin(); it != Dropped.end(); ++it) {
+    if((*it)->use_empty()) (*it)->eraseFromParent();
+  }
+}
+
+void MCJITHelper::dump() {
+  for(auto it = Modules.begin(); it != Modules.end(); ++it) {
+      (*it)->dump();
+  }
+}
+
+// Writes the named defs of every module, optimized, to one bitcode file
+// that -prelude can load. Top-level expressions are left out.
+bool MCJITHelper::emitPrelude(const std::string &Path) {
+  if(OpenModule && !OpenModule->empty() && resolveExternals(OpenModule)) compileOpenModule();
+
+  Module *Lib = new Module(Path, Context);
+  for(ModuleVector::iterator it = Modules.begin(); it != Modules.end(); ++it) {
+    if(*it == OpenModule) continue;
+    for(Module::iterator FI = (*it)->begin(), FE = (*it)->end(); FI != FE; ++FI) {
+      Function *Src = &*FI;
+      if(Src->isDeclaration() || Src->hasLocalLinkage()) continue;
+      if(Src->getName().startswith("anon_func_") || Src->getName().endswith(".entry") ||
+         Src->getName().endswith(".batch")) continue;
+      std::string ErrStr;
+      if(Src->Materialize(&ErrStr)) {
+        Errors.report("Cannot load '" + Src->getName().str() + "': " + ErrStr);
+        continue;
+      }
+
+      // Calls to defs copied earlier went to a declaration.
+      Function *F = CloneDefinitionInto(Src, Lib, "", Function::ExternalLinkage);
+      if(Function *Decl = Lib->getFunction(Src->getName())) {
+        Decl->replaceAllUsesWith(F);
+        F->takeName(Decl);
+        Decl->eraseFromParent();
+      } else {
+        F->setName(Src->getName());
+      }
+    }
+  }
+
+  std::string Bitcode;
+  raw_string_ostream OS(Bitcode);
+  WriteBitcodeToFile(Lib, OS);
+  OS.flush();
+  delete Lib;
+
+  FILE *F = fopen(Path.c_str(), "wb");
+  if(!F || fwrite(Bitcode.data(), 1, Bitcode.size(), F) != Bitcode.size() || fclose(F)) {
+    Errors.report("Cannot write prelude '" + Path + "'");
+    return false;
+  }
+  return true;
+}
+
+// Snapshot files
+//
+// A header, then per module a SnapshotModule record followed by its name,
+// bitcode and object, each padded to 8 bytes so the file can be mapped and
+// used in place. Prototypes and the symbol table travel in the bitcode.
+// Objects are only valid for the cpu they were compiled for, which the
+// header records.
+
+static const char SnapshotMagic[8] = { 'K', 'S', 'N', 'A', 'P', '0', '1', 0 };
+
+struct SnapshotHeader {
+  char Magic[8];
+  uint32_t NumModules;
+  uint32_t NextUniqueId;
+  uint64_t TargetLen;
+};
+
+struct SnapshotModule {
+  uint64_t NameLen;
+  uint64_t BitcodeLen;
+  uint64_t ObjectLen;
+};
+
+static uint64_t alignTo8(uint64_t N) { return (N + 7) & ~(uint64_t)7; }
+
+static void writePadded(FILE *F, StringRef Data) {
+  static const char Zeros[8] = { 0 };
+  fwrite(Data.data(), 1, Data.size(), F);
+  fwrite(Zeros, 1, alignTo8(Data.size()) - Data.size(), F);
+}
+
+// Takes Len bytes at Pos, or fails if the file is too short.
+static bool readPadded(StringRef File, uint64_t &Pos, uint64_t Len, StringRef &Out) {
+  if(Len > File.size() || Pos > File.size() - Len) return false;
+  Out = File.substr(Pos, Len);
+  Pos += alignTo8(Len);
+  return true;
+}
+
+std::string MCJITHelper::getTargetName() const {
+  std::string Name = TargetCPU;
+  for(unsigned i = 0, e = TargetAttrs.size(); i != e; ++i) Name += "," + TargetAttrs[i];
+  return Name;
+}
+
+// Compiles whatever is still open, then writes out every module that has
+// been compiled since the session started or was itself restored.
+bool MCJITHelper::snapshot(const std::string &Path) {
+  if(!Images.Recording) {
+    Errors.report("snapshot needs -snapshot given at startup");
+    return false;
+  }
+  if(OpenModule && !OpenModule->empty() && resolveExternals(OpenModule)) compileOpenModule();
+
+  std::vector<Module *> Saved;
+  for(ModuleVector::iterator it = Modules.begin(); it != Modules.end(); ++it) {
+    if(*it == OpenModule) continue;
+    const std::pair<StringRef, StringRef> &Image = Images.Images[*it];
+    if(!Image.first.empty() && !Image.second.empty()) Saved.push_back(*it);
+  }
+
+  FILE *F = fopen(Path.c_str(), "wb");
+  if(!F) {
+    Errors.report("Cannot write snapshot '" + Path + "': " + strerror(errno));
+    return false;
+  }
+
+  std::string Target = getTargetName();
+  SnapshotHeader H;
+  memcpy(H.Magic, SnapshotMagic, sizeof(H.Magic));
+  H.NumModules = Saved.size();
+  H.NextUniqueId = NextUniqueId;
+  H.TargetLen = Target.size();
+  fwrite(&H, sizeof(H), 1, F);
+  writePadded(F, Target);
+
+  for(unsigned i = 0, e = Saved.size(); i != e; ++i) {
+    const std::pair<StringRef, StringRef> &Image = Images.Images[Saved[i]];
+    SnapshotModule SM;
+    SM.NameLen = Saved[i]->getModuleIdentifier().size();
+    SM.BitcodeLen = Image.first.size();
+    SM.ObjectLen = Image.second.size();
+    fwrite(&SM, sizeof(SM), 1, F);
+    writePadded(F, Saved[i]->getModuleIdentifier());
+    writePadded(F, Image.first);
+    writePadded(F, Image.second);
+  }
+
+  bool Ok = !ferror(F);
+  if(fclose(F) || !Ok) {
+    Errors.report("Cannot write snapshot '" + Path + "'");
+    return false;
+  }
+  return true;
+}
+
+// Maps the snapshot and brings its modules back without running the
+// optimizer or codegen: bitcode is loaded lazily, so only the prototypes
+// are read, and MCJIT loads the saved objects through the image cache.
+// Arrays the snapshot uses must be bound before calling this.
+bool MCJITHelper::restore(const std::string &Path) {
+  ErrorOr<std::unique_ptr<MemoryBuffer> > File = MemoryBuffer::getFile(Path, -1, false);
+  if(!File) {
+    Errors.report("Cannot read snapshot '" + Path + "': " + File.getError().message());
+    return false;
+  }
+  StringRef Data = (*File)->getBuffer();
+
+  SnapshotHeader H;
+  StringRef Target;
+  uint64_t Pos = sizeof(H);
+  if(Data.size() < sizeof(H)) {
+    Errors.report("'" + Path + "' is not a snapshot");
+    return false;
+  }
+  memcpy(&H, Data.data(), sizeof(H));
+  if(memcmp(H.Magic, SnapshotMagic, sizeof(H.Magic)) || !readPadded(Data, Pos, H.TargetLen, Target)) {
+    Errors.report("'" + Path + "' is not a snapshot");
+    return false;
+  }
+  if(Target != getTargetName()) {
+    Errors.report("Snapshot '" + Path + "' was compiled for a different cpu");
+    return false;
+  }
+
+  std::vector<ExecutionEngine *> Restored;
+  for(uint32_t i = 0; i != H.NumModules; ++i) {
+    SnapshotModule SM;
+    StringRef Name, Bitcode, Object;
+    if(Pos > Data.size() || Data.size() - Pos < sizeof(SM)) break;
+    memcpy(&SM, Data.data() + Pos, sizeof(SM));
+    Pos += sizeof(SM);
+    if(!readPadded(Data, Pos, SM.NameLen, Name) || !readPadded(Data, Pos, SM.BitcodeLen, Bitcode) ||
+       !readPadded(Data, Pos, SM.ObjectLen, Object)) break;
+
+    std::unique_ptr<MemoryBuffer> Buffer(MemoryBuffer::getMemBuffer(Bitcode, Name, false));
+    ErrorOr<Module *> M = getLazyBitcodeModule(Buffer.get(), Context);
+    if(!M) {
+      Errors.report("Cannot load module '" + Name.str() + "': " + M.getError().message());
+      return false;
+    }
+    Buffer.release();
+
+    Images.Images[*M] = std::make_pair(Bitcode, Object);
+    Modules.push_back(*M);
+    Restored.push_back(createEngine(*M));
+    Engines.push_back(Restored.back());
+  }
+  if(Restored.size() != H.NumModules) {
+    Errors.report("Snapshot '" + Path + "' is truncated");
+    return false;
+  }
+
+  // In file order, so each module's externs are already loaded.
+  for(unsigned i = 0, e = Restored.size(); i != e; ++i) Restored[i]->finalizeObject();
+
+  if(NextUniqueId < (int)H.NextUniqueId) NextUniqueId = H.NextUniqueId;
+  Snapshots.push_back(std::move(*File));
+  return true;
+}
+
+// Math builtins
+
+// Calls to these names are emitted as LLVM intrinsics rather than opaque
+// externs, so the optimizer can constant fold them and the vectorizers can
+// widen them. A def with the same name takes precedence.
+struct MathBuiltin {
+  const char *Name;
+  Intrinsic::ID ID;
+  unsigned NumArgs;
+};
+
+static const MathBuiltin MathBuiltins[] = {
+  { "sqrt", Intrinsic::sqrt, 1 },
+  { "sin", Intrinsic::sin, 1 },
+  { "cos", Intrinsic::cos, 1 },
+  { "exp", Intrinsic::exp, 1 },
+  { "exp2", Intrinsic::exp2, 1 },
+  { "log", Intrinsic::log, 1 },
+  { "log2", Intrinsic::log2, 1 },
+  { "log10", Intrinsic::log10, 1 },
+  { "fabs", Intrinsic::fabs, 1 },
+  { "floor", Intrinsic::floor, 1 },
+  { "ceil", Intrinsic::ceil, 1 },
+  { "trunc", Intrinsic::trunc, 1 },
+  { "round", Intrinsic::round, 1 },
+  { "rint", Intrinsic::rint, 1 },
+  { "nearbyint", Intrinsic::nearbyint, 1 },
+  { "pow", Intrinsic::pow, 2 },
+  { "copysign", Intrinsic::copysign, 2 },
+  { "fma", Intrinsic::fma, 3 }
+};
+
+static const MathBuiltin *findMathBuiltin(const std::string &Name) {
+  for(unsigned i = 0, e = array_lengthof(MathBuiltins); i != e; ++i) {
+    if(Name == MathBuiltins[i].Name) return &MathBuiltins[i];
+  }
+  return 0;
+}
+
+static Function *getMathBuiltinDecl(const MathBuiltin *B, Module *M) {
+  return Intrinsic::getDeclaration(M, B->ID, Type::getDoubleTy(M->getContext()));
+}
+
+// Session
+
+// A columnar kernel computes Out[i] = F(Cols[0][i], ..., Cols[n-1][i]) for
+// every row i in [0, N).
+typedef void (*BatchKernelFn)(double *Out, double *const *Cols, int64_t N);
+
+class TieredCompiler;
+
+// Profile and dispatch slot of one def under -tiered. Callers reach the
+// def through a trampoline that calls whatever Slot holds: the
+// instrumented tier 1 code, then the recompiled tier 2 code.
+struct TierState {
+  TierState(FunctionAST *ast, const std::string &name)
+    : AST(ast), Name(name), Slot(0), NumCounters(0), Promoted(false) {}
+
+  FunctionAST *AST;
+  std::string Name;
+  std::atomic<void *> Slot;
+  // [0] counts entries, then per argument its last value (as bits) and
+  // how often it repeated, then a pair per branch; bumped by tier 1 code.
+  // Racing increments may be lost; it is only a profile.
+  std::unique_ptr<std::atomic<uint64_t>[]> Counters;
+  unsigned NumCounters;
+  // What tier 2 needs to recompile the def in another session.
+  std::vector<std::string> Callees;
+  std::vector<PrototypeAST *> Externs;
+  std::vector<std::pair<std::string, KArray *> > Arrays;
+  bool Promoted;
+
+  uint64_t getCount(unsigned Idx) const {
+    return Idx < NumCounters ? Counters[Idx].load(std::memory_order_relaxed) : 0;
+  }
+};
+
+// Entry points take their arguments as an array, so one signature fits
+// every def: double f.entry(const double *Args).
+typedef double (*EntryFn)(const double *Args);
+
+// A cluster of a context, an IR builder, a JIT and the symbol tables
+// codegen needs. Sessions share nothing mutable, so independent sessions
+// can compile and run concurrently on different threads.
+
+class Session {
+public:
+  Session();
+  ~Session();
+
+  void run(Lexer &L);
+  void runBatch(StringRef Source, const std::vector<std::string> &Roots, bool KeepAllDefs);
+  int watch(const std::string &Path);
+  bool addDefinitions(const std::string &Source);
+  EntryFn compileEntry(const std::string &Source, unsigned &NumArgs, std::string &DefName, Function **EntryF = 0);
+  BatchKernelFn getBatchKernel(const std::string &FnName);
+
+  Value *ErrorV(const char *Str) { Errors.report(Str); return 0; }
+  Function *ErrorF(const char *Str) { Errors.report(Str); return 0; }
+
+  Type *getKArrayPtrTy();
+  std::string symbolFor(const std::string &Name) const;
+  bool IsArrayName(const std::string &Name);
+  Value *LookupArray(const std::string &Name);
+
+  void enableTiering();
+  Function *CodegenTier1(Function *F, TierState *T);
+  Value *CodegenSlotCall(TierState *T, FunctionType *FT, std::vector<Value*> &Args);
+  void CountEvent(unsigned Idx);
+  void ProfileArguments(Function *F);
+  unsigned getBranchCounters(ExprAST *E);
+  uint64_t getCount(unsigned Idx) const;
+  void WeighBranch(BranchInst *BI, uint64_t TrueCount, uint64_t FalseCount);
+
+  LLVMContext Context;
+  IRBuilder<> Builder;
+  ErrorLog Errors;
+  MCJITHelper *JITHelper;
+  std::map<char, int> BinopPrecedence;
+  std::map<std::string, AllocaInst*> NamedValues;
+  std::map<std::string, Value*> NamedArrays;
+
+  // Tiered compilation. Profile is the def being compiled: tier 1 code
+  // bumps its counters (Instrument), tier 2 reads them back as weights.
+  TieredCompiler *Tiers;
+  TierState *Profile;
+  bool Instrument;
+  unsigned NextCounter;
+  // Counters of each if and for in the def, by node: a shared node may be
+  // emitted again in one tier but not the other, and must count the same.
+  std::map<ExprAST *, unsigned> BranchCounters;
+  // Tier 2: defs called through their slot rather than by name, and
+  // arguments of a specialized def folded in as constants.
+  std::map<std::string, TierState *> SlotCalls;
+  std::map<unsigned, double> ArgConstants;
+
+  // Effects of the defs compiled so far, for purity analysis of later ones.
+  std::map<std::string, Effects> DefEffects;
+
+  // Self tail calls branch back to TailRecurse after storing the new
+  // arguments in TailArgs (null for array parameters).
+  BasicBlock *TailRecurse;
+  std::vector<AllocaInst *> TailArgs;
+
+  // -watch recompiles a changed def under a new symbol, name.vN, as code
+  // already compiled still refers to the old one.
+  std::map<std::string, unsigned> DefVersions;
+
+  // Values of shared subexpressions emitted so far in the current def
+  // that are still valid at the insert point: their block dominates it and
+  // nothing emitted since may have changed them. Stores, rebinding a name
+  // and calls that may write memory invalidate them all; ValueGeneration
+  // counts that, so a node can tell whether its own code did.
+  std::map<ExprAST *, Value *> SharedValues;
+  unsigned ValueGeneration;
+  // Subexpressions being generated within one another; see CodegenShared.
+  unsigned CodegenDepth;
+  void invalidateValues() {
+    SharedValues.clear();
+    ++ValueGeneration;
+  }
+
+private:
+  Session(const Session &) = delete;
+  void operator=(const Session &) = delete;
+
+  void HandleDefinition(Parser &P);
+  void HandleExtern(Parser &P);
+  void HandleTopLevelExpression(Parser &P);
+  Function *CodegenBatchKernel(Function *RowF);
+  Function *CodegenEntry(Function *F);
+  unsigned parseItems(StringRef Source, std::vector<std::pair<FunctionAST *, PrototypeAST *> > &Items);
+
+  // ASTs of -batch inputs; tier 2 may recompile from them at any time.
+  std::vector<std::unique_ptr<BumpPtrAllocator> > ParseArenas;
+
+  StructType *KArrayTy;
+};
+
+// Code Generation
+
+Type *Session::getKArrayPtrTy() {
+  if(!KArrayTy) {
+    Type *Elts[] = { Type::getDoublePtrTy(Context), Type::getInt64Ty(Context) };
+    KArrayTy = StructType::create(Context, Elts, "karray");
+  }
+  return PointerType::getUnqual(KArrayTy);
+}
+
+std::string Session::symbolFor(const std::string &Name) const {
+  std::map<std::string, unsigned>::const_iterator it = DefVersions.find(Name);
+  if(it == DefVersions.end() || it->second == 0) return Name;
+  return Name + ".v" + std::to_string(it->second);
+}
+
+bool Session::IsArrayName(const std::string &Name) {
+  if(NamedValues.count(Name)) return false;
+  return NamedArrays.count(Name) || JITHelper->isBoundArray(Name);
+}
+
+// Arrays are either array parameters of the current function or host
+// buffers bound with MCJITHelper::bindArray; both are %karray pointers.
+Value *Session::LookupArray(const std::string &Name) {
+  if(NamedValues.count(Name)) return 0;
+
+  std::map<std::string, Value*>::iterator it = NamedArrays.find(Name);
+  if(it != NamedArrays.end()) return it->second;
+
+  if(!JITHelper->isBoundArray(Name)) return 0;
+
+  Module *M = JITHelper->getModuleForNewFunction();
+  if(GlobalVariable *GV = M->getGlobalVariable(Name)) return GV;
+  getKArrayPtrTy();
+  return new GlobalVariable(*M, KArrayTy, false, GlobalValue::ExternalLinkage, 0, Name);
+}
+
+// Every mutable variable lives in an entry-block alloca; mem2reg in the
+// function pass pipeline turns them back into SSA registers.
+static AllocaInst *CreateEntryBlockAlloca(Function *TheFunction, const std::string &VarName) {
+  IRBuilder<> TmpB(&TheFunction->getEntryBlock(), TheFunction->getEntryBlock().begin());
+  return TmpB.CreateAlloca(Type::getDoubleTy(TheFunction->getContext()), 0, VarName.c_str());
+}
+
+// The parser takes any depth, but only operator chains are generated
+// without recursion; nesting through calls, ifs, loops and vars beyond
+// this is an error rather than a native stack overflow.
+static const unsigned MaxCodegenDepth = 1024;
+
+Value *ExprAST::CodegenShared(Session &S) {
+  if(Shared) {
+    std::map<ExprAST *, Value *>::iterator it = S.SharedValues.find(this);
+    if(it != S.SharedValues.end()) return it->second;
+  }
+  if(S.CodegenDepth == MaxCodegenDepth) return S.ErrorV("expression nested too deeply");
+
+  unsigned Generation = S.ValueGeneration;
+  ++S.CodegenDepth;
+  Value *V = Codegen(S);
+  --S.CodegenDepth;
+  if(Shared && V && S.ValueGeneration == Generation) S.SharedValues[this] = V;
+  return V;
+}
+
+Value *NumberExprAST::Codegen(Session &S) {
+  return ConstantFP::get(S.Context, APFloat(Val));
+}
+
+
+Value *VariableExprAST::Codegen(Session &S) {
+  Value *V = S.NamedValues[Name];
+  if(V == 0) {
+    if(S.IsArrayName(Name)) return S.ErrorV("array used where a number was expected");
+    return S.ErrorV("Unknown variable name");
+  }
+  return S.Builder.CreateLoad(V, Name.c_str());
+}
+
+// Element accesses are unchecked, as in C; use len(a) to bound loops.
+Value *IndexExprAST::CodegenAddress(Session &S) {
+  Value *Array = S.LookupArray(Name);
+  if(Array == 0) return S.ErrorV("Unknown array name");
+
+  Value *IdxV = Index->CodegenShared(S);
+  if(IdxV == 0) return 0;
+  IdxV = S.Builder.CreateFPToSI(IdxV, Type::getInt64Ty(S.Context), "idx");
+
+  Value *Data = S.Builder.CreateLoad(S.Builder.CreateStructGEP(Array, 0), "data");
+  return S.Builder.CreateGEP(Data, IdxV, "elemptr");
+}
+
+Value *IndexExprAST::Codegen(Session &S) {
+  Value *Addr = CodegenAddress(S);
+  if(Addr == 0) return 0;
+  return S.Builder.CreateLoad(Addr, "elem");
+}
+
+bool BinaryExprAST::isMul(ExprAST *E) {
+  BinaryExprAST *B = dyn_cast<BinaryExprAST>(E);
+  return B && B->Op == '*';
+}
+
+bool BinaryExprAST::isMulAdd() const {
+  return (Op == '+' || Op == '-') && getFPContractMode() != FPOpFusion::Strict && (isMul(LHS) || isMul(RHS));
+}
+
+// Pushes the operands to evaluate, last one first. A multiply-add has
+// three: those of the multiply and the other operand, still left to right.
+void BinaryExprAST::pushOperands(std::vector<ExprAST*> &Work) const {
+  if(!isMulAdd()) {
+    Work.push_back(RHS);
+    Work.push_back(LHS);
+  } else if(isMul(LHS)) {
+    BinaryExprAST *Mul = static_cast<BinaryExprAST*>(LHS);
+    Work.push_back(RHS);
+    Work.push_back(Mul->RHS);
+    Work.push_back(Mul->LHS);
+  } else {
+    BinaryExprAST *Mul = static_cast<BinaryExprAST*>(RHS);
+    Work.push_back(Mul->RHS);
+    Work.push_back(Mul->LHS);
+    Work.push_back(LHS);
+  }
+}
+
+// a*b+c, c+a*b, a*b-c and c-a*b become llvm.fmuladd, which the backend
+// fuses into a single FMA when the target has one.
+Value *BinaryExprAST::CodegenMulAdd(Session &S, Value *A, Value *B, Value *C) {
+  if(Op == '-') {
+    if(isMul(LHS)) C = S.Builder.CreateFNeg(C, "negtmp");
+    else A = S.Builder.CreateFNeg(A, "negtmp");
+  }
+
+  Module *M = S.Builder.GetInsertBlock()->getParent()->getParent();
+  Function *FMulAdd = Intrinsic::getDeclaration(M, Intrinsic::fmuladd, Type::getDoubleTy(S.Context));
+  Value *Ops[] = { A, B, C };
+  return S.Builder.CreateCall(FMulAdd, Ops, "fmuladdtmp");
+}
+
+Value *BinaryExprAST::Codegen(Session &S) {
+  if(Op == '=') {
+    if(IndexExprAST *LHSI = dyn_cast<IndexExprAST>(LHS)) {
+      Value *Val = RHS->CodegenShared(S);
+      if(Val == 0) return 0;
+
+      Value *Addr = LHSI->CodegenAddress(S);
+      if(Addr == 0) return 0;
+
+      S.Builder.CreateStore(Val, Addr);
+      S.invalidateValues();
+      return Val;
+    }
+
+    VariableExprAST *LHSE = dyn_cast<VariableExprAST>(LHS);
+    if(!LHSE) return S.ErrorV("destination of '=' must be a variable or array element");
+
+    Value *Val = RHS->CodegenShared(S);
+    if(Val == 0) return 0;
+
+    Value *Variable = S.NamedValues[LHSE->getName()];
+    if(Variable == 0) return S.ErrorV("Unknown variable name");
+
+    S.Builder.CreateStore(Val, Variable);
+    S.invalidateValues();
+    return Val;
+  }
+
+  // A chain like a+b+c+... or a*b+c*d+... nests as deep as it is long,
+  // so the operators under this one other than '=' are evaluated from an
+  // explicit stack, left operand first, doing CodegenShared's bookkeeping
+  // for shared ones; other subexpressions generate themselves.
+  struct Step {
+    ExprAST *E;
+    bool Expanded;
+    unsigned Generation;
+  };
+  std::vector<Step> Work(1, Step{ this, false, 0 });
+  std::vector<ExprAST*> Operands;
+  std::vector<Value*> Values;
+  while(!Work.empty()) {
+    Step W = Work.back();
+    Work.pop_back();
+    BinaryExprAST *B = dyn_cast<BinaryExprAST>(W.E);
+    if(W.Expanded) {
+      Value *V;
+      if(B->isMulAdd()) {
+        Value **Ops = &Values[Values.size() - 3];
+        V = isMul(B->LHS) ? B->CodegenMulAdd(S, Ops[0], Ops[1], Ops[2])
+                          : B->CodegenMulAdd(S, Ops[1], Ops[2], Ops[0]);
+        Values.resize(Values.size() - 2);
+      } else {
+        V = B->CodegenOp(S, Values[Values.size() - 2], Values.back());
+        Values.pop_back();
+      }
+      Values.back() = V;
+      if(V == 0) return 0;
+      if(B->Shared && W.Generation == S.ValueGeneration) S.SharedValues[B] = V;
+    } else if(B && B->Op != '=' && (B == this || !S.SharedValues.count(B))) {
+      Work.push_back(Step{ B, true, S.ValueGeneration });
+      Operands.clear();
+      B->pushOperands(Operands);
+      for(unsigned i = 0; i != Operands.size(); ++i) Work.push_back(Step{ Operands[i], false, 0 });
+    } else {
+      Values.push_back(W.E->CodegenShared(S));
+      if(Values.back() == 0) return 0;
+    }
+  }
+  return Values.back();
+}
+
+Value *BinaryExprAST::CodegenOp(Session &S, Value *L, Value *R) {
+  switch(Op) {
+  case '+' : return S.Builder.CreateFAdd(L, R, "addtmp");
+  case '-' : return S.Builder.CreateFSub(L, R, "subtmp");
+  case '*' : return S.Builder.CreateFMul(L, R, "multmp");
+  case '<' :
+    L = S.Builder.CreateFCmpULT(L, R, "cmptmp");
+    return S.Builder.CreateUIToFP(L, Type::getDoubleTy(S.Context), "booltmp");
+  default : return S.ErrorV("invalid binary operator");
+  }
+}
+
+Value *CallExprAST::CodegenArrayLength(Session &S) {
+  VariableExprAST *Arg = dyn_cast<VariableExprAST>(Args[0]);
+  Value *Array = Arg ? S.LookupArray(Arg->getName()) : 0;
+  if(Array == 0) return S.ErrorV("len() expects an array");
+
+  Value *Len = S.Builder.CreateLoad(S.Builder.CreateStructGEP(Array, 1), "len");
+  return S.Builder.CreateSIToFP(Len, Type::getDoubleTy(S.Context), "lentmp");
+}
+
+Value *CallExprAST::Codegen(Session &S) {
+  std::map<std::string, TierState *>::iterator Slot = S.SlotCalls.find(Callee);
+  Function *CalleeF = 0;
+  FunctionType *FT;
+  if(Slot != S.SlotCalls.end()) {
+    FT = Slot->second->AST->getProto()->getType(S);
+  } else {
+    CalleeF = S.JITHelper->getFunction(S.symbolFor(Callee));
+    if(CalleeF == 0 && Callee == "len" && Args.size() == 1) return CodegenArrayLength(S);
+    if(CalleeF == 0) {
+      if(const MathBuiltin *B = findMathBuiltin(Callee)) {
+        CalleeF = getMathBuiltinDecl(B, S.JITHelper->getModuleForNewFunction());
+      }
+    }
+    if(CalleeF == 0) return S.ErrorV("Unknown function referenced");
+    FT = CalleeF->getFunctionType();
+  }
+
+  if(FT->getNumParams() != Args.size()) return S.ErrorV("Incorrect # arguments passed");
 
   std::vector<Value*> ArgsV;
   for(unsigned int i = 0, e = Args.size(); i != e; ++i) {
-    ArgsV.push_back(Args[i]->Codegen());
+    // Arrays are passed by reference: only a bare array name can be
+    // bound to an array parameter.
+    if(FT->getParamType(i)->isPointerTy()) {
+      VariableExprAST *Arg = dyn_cast<VariableExprAST>(Args[i]);
+      ArgsV.push_back(Arg ? S.LookupArray(Arg->getName()) : 0);
+      if(ArgsV.back() == 0) return S.ErrorV("array argument expected");
+      continue;
+    }
+
+    ArgsV.push_back(Args[i]->CodegenShared(S));
     if(ArgsV.back() == 0) return 0;
   }
 
-  return Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+  if(!CalleeF) {
+    CallInst *Call = cast<CallInst>(S.CodegenSlotCall(Slot->second, FT, ArgsV));
+    Call->setTailCall(IsTail);
+    S.invalidateValues();
+    return Call;
+  }
+  Function *Caller = S.Builder.GetInsertBlock()->getParent();
+  if(IsTail && CalleeF == Caller && S.TailRecurse && S.TailRecurse->getParent() == Caller) {
+    if(Value *V = CodegenSelfTailCall(S, Caller, ArgsV)) return V;
+  }
+  // Kaleidoscope code never hands out pointers to its allocas, so any
+  // call in tail position can be marked; the backend turns those into
+  // sibling calls.
+  CallInst *Call = S.Builder.CreateCall(CalleeF, ArgsV, "calltmp");
+  Call->setTailCall(IsTail);
+  if(!CalleeF->onlyReadsMemory()) S.invalidateValues();
+  return Call;
 }
 
-Function *PrototypeAST::Codegen() {
-  std::vector<Type*> Doubles(Args.size(), Type::getDoubleTy(getGlobalContext()));
-  FunctionType *FT = FunctionType::get(Type::getDoubleTy(getGlobalContext()), Doubles, false);
-  std::string FnName = MakeLegalFunctionName(Name);
-  Module *M = JITHelper->getModuleForNewFunction();
+// A call to the enclosing def in tail position becomes a jump back to the
+// top of its body, so tail-recursive defs run in constant stack. Array
+// parameters have no alloca to rebind; calls that pass a different array
+// stay calls. The code after the jump is unreachable and only gives the
+// caller's codegen a place to continue.
+Value *CallExprAST::CodegenSelfTailCall(Session &S, Function *F, std::vector<Value*> &ArgsV) {
+  Function::arg_iterator AI = F->arg_begin();
+  for(unsigned i = 0, e = ArgsV.size(); i != e; ++i, ++AI) {
+    if(!S.TailArgs[i] && ArgsV[i] != AI) return 0;
+  }
+  for(unsigned i = 0, e = ArgsV.size(); i != e; ++i) {
+    if(S.TailArgs[i]) S.Builder.CreateStore(ArgsV[i], S.TailArgs[i]);
+  }
+  S.Builder.CreateBr(S.TailRecurse);
+  S.invalidateValues();
+
+  S.Builder.SetInsertPoint(BasicBlock::Create(S.Context, "tailcont", F));
+  return UndefValue::get(Type::getDoubleTy(S.Context));
+}
+
+Value *IfExprAST::Codegen(Session &S) {
+  Value *CondV = Cond->CodegenShared(S);
+  if(CondV == 0) return 0;
+
+  CondV = S.Builder.CreateFCmpONE(CondV, ConstantFP::get(S.Context, APFloat(0.0)), "ifcond");
+
+  Function *TheFunction = S.Builder.GetInsertBlock()->getParent();
+
+  BasicBlock *ThenBB = BasicBlock::Create(S.Context, "then", TheFunction);
+  BasicBlock *ElseBB = BasicBlock::Create(S.Context, "else");
+  BasicBlock *MergeBB = BasicBlock::Create(S.Context, "ifcont");
+
+  unsigned Count = S.getBranchCounters(this);
+  BranchInst *BI = S.Builder.CreateCondBr(CondV, ThenBB, ElseBB);
+  S.WeighBranch(BI, S.getCount(Count), S.getCount(Count + 1));
+
+  // Values first emitted in one arm do not dominate the other or the
+  // merge; values from before the if stay valid unless an arm wrote memory.
+  std::map<ExprAST *, Value *> CondValues = S.SharedValues;
+  unsigned Generation = S.ValueGeneration;
+
+  S.Builder.SetInsertPoint(ThenBB);
+  S.CountEvent(Count);
+  Value *ThenV = Then->CodegenShared(S);
+  if(ThenV == 0) return 0;
+  S.Builder.CreateBr(MergeBB);
+  // Codegen of 'Then' can change the current block.
+  ThenBB = S.Builder.GetInsertBlock();
+
+  TheFunction->getBasicBlockList().push_back(ElseBB);
+  S.Builder.SetInsertPoint(ElseBB);
+  S.CountEvent(Count + 1);
+  S.SharedValues = CondValues;
+  Value *ElseV = Else->CodegenShared(S);
+  if(ElseV == 0) return 0;
+  S.Builder.CreateBr(MergeBB);
+  ElseBB = S.Builder.GetInsertBlock();
+
+  TheFunction->getBasicBlockList().push_back(MergeBB);
+  S.Builder.SetInsertPoint(MergeBB);
+  if(S.ValueGeneration == Generation) S.SharedValues.swap(CondValues);
+  else S.SharedValues.clear();
+  PHINode *PN = S.Builder.CreatePHI(Type::getDoubleTy(S.Context), 2, "iftmp");
+  PN->addIncoming(ThenV, ThenBB);
+  PN->addIncoming(ElseV, ElseBB);
+  return PN;
+}
+
+// 'for x = start, end, step in body' tests 'end' before every iteration,
+// like a C for loop, and always evaluates to 0.0. The loop is emitted
+// already rotated, in the shape LoopSimplify/LoopRotate would produce:
+//
+//   guard:     x = start; if !end goto afterloop
+//   preheader: goto loop
+//   loop:      body; x = x + step
+//              if end goto loop else goto loopexit
+//   loopexit:  goto afterloop
+//
+// x lives in an alloca, which mem2reg turns into the header phi, so the
+// loop passes can pick it up without canonicalizing it first.
+Value *ForExprAST::Codegen(Session &S) {
+  Function *TheFunction = S.Builder.GetInsertBlock()->getParent();
+  AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+
+  Value *StartVal = Start->CodegenShared(S);
+  if(StartVal == 0) return 0;
+
+  S.Builder.CreateStore(StartVal, Alloca);
+
+  AllocaInst *OldVal = S.NamedValues[VarName];
+  S.NamedValues[VarName] = Alloca;
+  S.invalidateValues();
+
+  Value *Zero = ConstantFP::get(S.Context, APFloat(0.0));
+
+  Value *GuardCond = End->CodegenShared(S);
+  if(GuardCond == 0) return 0;
+  GuardCond = S.Builder.CreateFCmpONE(GuardCond, Zero, "guardcond");
+
+  BasicBlock *PreheaderBB = BasicBlock::Create(S.Context, "preheader", TheFunction);
+  BasicBlock *LoopBB = BasicBlock::Create(S.Context, "loop");
+  BasicBlock *ExitBB = BasicBlock::Create(S.Context, "loopexit");
+  BasicBlock *AfterBB = BasicBlock::Create(S.Context, "afterloop");
+
+  S.Builder.CreateCondBr(GuardCond, PreheaderBB, AfterBB);
+
+  S.Builder.SetInsertPoint(PreheaderBB);
+  S.Builder.CreateBr(LoopBB);
+
+  // Counts iterations and exits; the latch is taken iterations - exits times.
+  unsigned Count = S.getBranchCounters(this);
+  uint64_t Iterations = S.getCount(Count), Exits = S.getCount(Count + 1);
+
+  TheFunction->getBasicBlockList().push_back(LoopBB);
+  S.Builder.SetInsertPoint(LoopBB);
+  S.CountEvent(Count);
+  // The body sees memory written by earlier iterations.
+  S.invalidateValues();
+
+  if(Body->CodegenShared(S) == 0) return 0;
+
+  Value *StepVal;
+  if(Step) {
+    StepVal = Step->CodegenShared(S);
+    if(StepVal == 0) return 0;
+  } else {
+    StepVal = ConstantFP::get(S.Context, APFloat(1.0));
+  }
+
+  Value *CurVar = S.Builder.CreateLoad(Alloca, VarName.c_str());
+  Value *NextVar = S.Builder.CreateFAdd(CurVar, StepVal, "nextvar");
+  S.Builder.CreateStore(NextVar, Alloca);
+  S.invalidateValues();
+
+  Value *EndCond = End->CodegenShared(S);
+  if(EndCond == 0) return 0;
+  EndCond = S.Builder.CreateFCmpONE(EndCond, Zero, "loopcond");
+
+  BranchInst *Latch = S.Builder.CreateCondBr(EndCond, LoopBB, ExitBB);
+  S.WeighBranch(Latch, Iterations > Exits ? Iterations - Exits : 0, Exits);
+
+  TheFunction->getBasicBlockList().push_back(ExitBB);
+  S.Builder.SetInsertPoint(ExitBB);
+  S.CountEvent(Count + 1);
+  S.Builder.CreateBr(AfterBB);
+
+  TheFunction->getBasicBlockList().push_back(AfterBB);
+  S.Builder.SetInsertPoint(AfterBB);
+
+  if(OldVal) S.NamedValues[VarName] = OldVal;
+  else S.NamedValues.erase(VarName);
+  S.invalidateValues();
+
+  return Zero;
+}
+
+Value *VarExprAST::Codegen(Session &S) {
+  std::vector<AllocaInst *> OldBindings;
+
+  Function *TheFunction = S.Builder.GetInsertBlock()->getParent();
+
+  for(unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+    const std::string &VarName = VarNames[i].first;
+    ExprAST *Init = VarNames[i].second;
+
+    // The initializer is evaluated before the variable is in scope, so
+    // 'var a = a in ...' refers to an outer 'a'.
+    Value *InitVal;
+    if(Init) {
+      InitVal = Init->CodegenShared(S);
+      if(InitVal == 0) return 0;
+    } else {
+      InitVal = ConstantFP::get(S.Context, APFloat(0.0));
+    }
+
+    AllocaInst *Alloca = CreateEntryBlockAlloca(TheFunction, VarName);
+    S.Builder.CreateStore(InitVal, Alloca);
+
+    OldBindings.push_back(S.NamedValues[VarName]);
+    S.NamedValues[VarName] = Alloca;
+    S.invalidateValues();
+  }
+
+  Value *BodyVal = Body->CodegenShared(S);
+  if(BodyVal == 0) return 0;
+
+  for(unsigned i = 0, e = VarNames.size(); i != e; ++i) {
+    if(OldBindings[i]) S.NamedValues[VarNames[i].first] = OldBindings[i];
+    else S.NamedValues.erase(VarNames[i].first);
+  }
+  S.invalidateValues();
+
+  return BodyVal;
+}
+
+FunctionType *PrototypeAST::getType(Session &S) {
+  std::vector<Type*> ArgTys;
+  for(unsigned i = 0, e = Args.size(); i != e; ++i) {
+    ArgTys.push_back(ArgIsArray[i] ? S.getKArrayPtrTy() : Type::getDoubleTy(S.Context));
+  }
+  return FunctionType::get(Type::getDoubleTy(S.Context), ArgTys, false);
+}
+
+Function *PrototypeAST::Codegen(Session &S) {
+  FunctionType *FT = getType(S);
+  std::string FnName = S.symbolFor(MakeLegalFunctionName(Name));
+  Module *M = S.JITHelper->getModuleForNewFunction();
+
+  if(IsExtern && !S.JITHelper->getFunction(FnName)) {
+    if(const MathBuiltin *B = findMathBuiltin(Name)) {
+      if(B->NumArgs != Args.size() || std::count(ArgIsArray.begin(), ArgIsArray.end(), true)) {
+        S.ErrorF("extern of math builtin with different # args");
+        return 0;
+      }
+      return getMathBuiltinDecl(B, M);
+    }
+  }
+
   Function *F = Function::Create(FT, Function::ExternalLinkage, FnName, M);
 
   if(F->getName() != FnName) {
     F->eraseFromParent();
-    F = JITHelper->getFunction(Name);
+    F = S.JITHelper->getFunction(FnName);
 
-    if(!F->empty()) {
-      ErrorF("redefinition of function");
+    // An extern of something already defined, e.g. by a prelude, is fine.
+    if(!F->empty() && !IsExtern) {
+      S.ErrorF("redefinition of function");
       return 0;
     }
 
     if(F->arg_size() != Args.size()) {
-      ErrorF("redefinition of function with different # args");
+      S.ErrorF("redefinition of function with different # args");
+    } else if(F->getFunctionType() != FT) {
+      S.ErrorF("redefinition of function with different argument types");
+      return 0;
     }
   }
 
   unsigned Idx = 0;
   for(Function::arg_iterator AI = F->arg_begin(); Idx != Args.size(); ++AI, ++Idx) {
     AI->setName(Args[Idx]);
-    NamedValues[Args[Idx]] = AI;
   }
 
   return F;
 }
 
-Function *FunctionAST::Codegen() {
-  NamedValues.clear();
+void PrototypeAST::CreateArgumentAllocas(Session &S, Function *F) {
+  Function::arg_iterator AI = F->arg_begin();
+  for(unsigned Idx = 0, e = Args.size(); Idx != e; ++Idx, ++AI) {
+    if(ArgIsArray[Idx]) {
+      S.NamedArrays[Args[Idx]] = AI;
+      S.TailArgs.push_back(0);
+      continue;
+    }
+
+    AllocaInst *Alloca = CreateEntryBlockAlloca(F, Args[Idx]);
+    std::map<unsigned, double>::iterator C = S.ArgConstants.find(Idx);
+    if(C != S.ArgConstants.end()) S.Builder.CreateStore(ConstantFP::get(S.Context, APFloat(C->second)), Alloca);
+    else S.Builder.CreateStore(AI, Alloca);
+    S.NamedValues[Args[Idx]] = Alloca;
+    S.TailArgs.push_back(Alloca);
+  }
+}
+
+// A def is pure if it only calls pure defs, math builtins and itself, and
+// stores to no array; reading arrays still makes it readonly. Externs
+// such as putchard, and defs compiled later, are assumed to write memory.
+Effects FunctionAST::analyzeEffects(Session &S) const {
+  Effects Result = ReadsNothing;
+  std::vector<ExprAST*> Work(1, Body);
+  while(!Work.empty() && Result != WritesMemory) {
+    ExprAST *E = Work.back();
+    Work.pop_back();
+    E->getChildren(Work);
+
+    if(BinaryExprAST *B = dyn_cast<BinaryExprAST>(E)) {
+      if(B->isArrayStore()) Result = WritesMemory;
+    } else if(isa<IndexExprAST>(E)) {
+      Result = std::max(Result, ReadsArrays);
+    } else if(CallExprAST *C = dyn_cast<CallExprAST>(E)) {
+      const std::string &Callee = C->getCallee();
+      if(Callee == Proto->getName()) continue;
+      std::map<std::string, Effects>::iterator it = S.DefEffects.find(Callee);
+      if(it != S.DefEffects.end()) Result = std::max(Result, it->second);
+      else if(S.JITHelper->hasFunction(S.symbolFor(Callee))) Result = WritesMemory;
+      else if(Callee == "len") Result = std::max(Result, ReadsArrays);
+      else if(!findMathBuiltin(Callee)) Result = WritesMemory;
+    }
+  }
+  return Result;
+}
+
+// Puts a direct-mapped cache of results in front of F's body, which moves
+// to F.memo.body; recursive calls still go through F and hit the cache.
+// Threads may share the code, so each entry is a seqlock: a sequence
+// word, then the result and argument bits. A writer claims the entry by
+// making the sequence odd, giving up if another writer holds it, and makes
+// it even again when done; a lookup only hits if it read the same nonzero
+// even sequence before and after the other words, so it never sees a torn
+// entry. The zeroed table is empty.
+Function *FunctionAST::CodegenMemo(Session &S, Function *F) {
+  LLVMContext &C = S.Context;
+  Module *M = F->getParent();
+  unsigned NumArgs = F->arg_size();
+  Type *I64 = Type::getInt64Ty(C);
+
+  Function *MemoBody = Function::Create(F->getFunctionType(), Function::InternalLinkage,
+                                        F->getName() + ".memo.body", M);
+  MemoBody->getBasicBlockList().splice(MemoBody->begin(), F->getBasicBlockList());
+  Function::arg_iterator BI = MemoBody->arg_begin();
+  for(Function::arg_iterator AI = F->arg_begin(); AI != F->arg_end(); ++AI, ++BI) {
+    BI->takeName(AI);
+    AI->replaceAllUsesWith(BI);
+  }
+  MemoBody->setAttributes(F->getAttributes());
+  F->removeFnAttr(Attribute::ReadNone);
+
+  uint64_t Entries = 1ULL << MemoCacheBits;
+  ArrayType *EntryTy = ArrayType::get(I64, NumArgs + 2);
+  ArrayType *CacheTy = ArrayType::get(EntryTy, Entries);
+  GlobalVariable *Cache = new GlobalVariable(*M, CacheTy, false, GlobalValue::InternalLinkage,
+                                             ConstantAggregateZero::get(CacheTy), F->getName() + ".memo");
+
+  BasicBlock *Entry = BasicBlock::Create(C, "entry", F);
+  BasicBlock *Hit = BasicBlock::Create(C, "hit", F);
+  BasicBlock *Miss = BasicBlock::Create(C, "miss", F);
+  IRBuilder<> B(Entry);
+
+  std::vector<Value*> Args, Bits;
+  Value *Hash = B.getInt64(0);
+  for(Function::arg_iterator AI = F->arg_begin(); AI != F->arg_end(); ++AI) {
+    Args.push_back(AI);
+    Bits.push_back(B.CreateBitCast(AI, I64, "bits"));
+    Hash = B.CreateMul(B.CreateXor(Hash, Bits.back()), B.getInt64(0x9e3779b97f4a7c15ULL), "hash");
+  }
+  Value *Slot = NumArgs ? B.CreateLShr(Hash, 64 - MemoCacheBits, "slot") : B.getInt64(0);
+
+  auto AtomicLoad = [&](Value *Ptr, AtomicOrdering Order, const char *Name) {
+    LoadInst *L = B.CreateLoad(Ptr, Name);
+    L->setAtomic(Order);
+    L->setAlignment(8);
+    return L;
+  };
+  auto AtomicStore = [&](Value *Val, Value *Ptr, AtomicOrdering Order) {
+    StoreInst *St = B.CreateStore(Val, Ptr);
+    St->setAtomic(Order);
+    St->setAlignment(8);
+  };
+
+  Value *Idx[] = { B.getInt64(0), Slot, B.getInt64(0) };
+  Value *Seq = B.CreateInBoundsGEP(Cache, Idx, "entry");
+  Value *Before = AtomicLoad(Seq, Acquire, "seq");
+  Value *Result = AtomicLoad(B.CreateConstGEP1_32(Seq, 1), Monotonic, "cached");
+  Value *Match = B.getTrue();
+  for(unsigned i = 0; i != NumArgs; ++i) {
+    Value *Word = AtomicLoad(B.CreateConstGEP1_32(Seq, i + 2), Monotonic, "key");
+    Match = B.CreateAnd(Match, B.CreateICmpEQ(Word, Bits[i]), "match");
+  }
+  B.CreateFence(Acquire);
+  Value *After = AtomicLoad(Seq, Monotonic, "seq.after");
+  Value *Stable = B.CreateAnd(B.CreateICmpEQ(Before, After),
+                              B.CreateICmpEQ(B.CreateAnd(Before, B.getInt64(1)), B.getInt64(0)), "stable");
+  Stable = B.CreateAnd(Stable, B.CreateICmpNE(Before, B.getInt64(0)), "filled");
+  B.CreateCondBr(B.CreateAnd(Match, Stable, "hit"), Hit, Miss);
+
+  B.SetInsertPoint(Hit);
+  B.CreateRet(B.CreateBitCast(Result, Type::getDoubleTy(C)));
+
+  BasicBlock *Fill = BasicBlock::Create(C, "fill", F);
+  BasicBlock *Done = BasicBlock::Create(C, "done", F);
+  B.SetInsertPoint(Miss);
+  Value *V = B.CreateCall(MemoBody, Args, "calltmp");
+  // An odd sequence seen above fails the exchange: the entry is busy.
+  Value *Even = B.CreateAnd(Before, B.getInt64(~1ULL), "even");
+  Value *Claim = B.CreateAtomicCmpXchg(Seq, Even, B.CreateAdd(Even, B.getInt64(1)), Monotonic, Monotonic);
+  B.CreateCondBr(B.CreateExtractValue(Claim, 1, "claimed"), Fill, Done);
+
+  B.SetInsertPoint(Fill);
+  B.CreateFence(Release);
+  AtomicStore(B.CreateBitCast(V, I64, "bits"), B.CreateConstGEP1_32(Seq, 1), Monotonic);
+  for(unsigned i = 0; i != NumArgs; ++i) AtomicStore(Bits[i], B.CreateConstGEP1_32(Seq, i + 2), Monotonic);
+  AtomicStore(B.CreateAdd(Even, B.getInt64(2)), Seq, Release);
+  B.CreateBr(Done);
+
+  B.SetInsertPoint(Done);
+  B.CreateRet(V);
+
+  verifyFunction(*F);
+  return F;
+}
+
+Function *FunctionAST::Codegen(Session &S) {
+  S.NamedValues.clear();
+  S.NamedArrays.clear();
 
-  Function *TheFunction = Proto->Codegen();
+  Function *TheFunction = Proto->Codegen(S);
   if(TheFunction == 0) return 0;
 
-  BasicBlock *BB = BasicBlock::Create(getGlobalContext(), "entry", TheFunction);
-  Builder.SetInsertPoint(BB);
+  // Under -tiered every named def starts out instrumented.
+  TierState *Tier = 0;
+  if(S.Tiers && !Proto->getName().empty()) S.Profile = Tier = new TierState(this, TheFunction->getName().str());
+  S.NextCounter = 1;
+  S.BranchCounters.clear();
+
+  BasicBlock *BB = BasicBlock::Create(S.Context, "entry", TheFunction);
+  S.Builder.SetInsertPoint(BB);
+
+  S.TailArgs.clear();
+  Proto->CreateArgumentAllocas(S, TheFunction);
+  S.CountEvent(0);
+  S.ProfileArguments(TheFunction);
+
+  S.TailRecurse = BasicBlock::Create(S.Context, "tailrecurse", TheFunction);
+  S.Builder.CreateBr(S.TailRecurse);
+  S.Builder.SetInsertPoint(S.TailRecurse);
+  // A shared node also stands for occurrences outside tail position.
+  std::vector<ExprAST*> TailExprs(1, Body);
+  while(!TailExprs.empty()) {
+    ExprAST *E = TailExprs.back();
+    TailExprs.pop_back();
+    if(!E->Shared) E->markTail(TailExprs);
+  }
+  S.invalidateValues();
 
-  if(Value *RetVal = Body->Codegen()) {
-    Builder.CreateRet(RetVal);
+  Value *RetVal = Body->Codegen(S);
+  S.TailRecurse = 0;
+  if(RetVal) {
+    S.Builder.CreateRet(RetVal);
     verifyFunction(*TheFunction);
+
+    Effects E = analyzeEffects(S);
+    if(Memo) {
+      bool Scalar = true;
+      for(Function::arg_iterator AI = TheFunction->arg_begin(); AI != TheFunction->arg_end(); ++AI)
+        Scalar &= AI->getType()->isDoubleTy();
+      if(E != ReadsNothing || !Scalar) {
+        TheFunction->eraseFromParent();
+        delete Tier;
+        S.Profile = 0;
+        return S.ErrorF("memo needs a pure function of numbers");
+      }
+    }
+    if(!Proto->getName().empty()) S.DefEffects[Proto->getName()] = E;
+    // Nothing Kaleidoscope calls unwinds.
+    TheFunction->addFnAttr(Attribute::NoUnwind);
+    // Tier 1 code writes its profile counters.
+    if(Tier && S.Instrument) E = WritesMemory;
+    if(E == ReadsNothing) TheFunction->addFnAttr(Attribute::ReadNone);
+    else if(E == ReadsArrays) TheFunction->addFnAttr(Attribute::ReadOnly);
+    // The wrapper writes its cache, so only the body keeps readnone.
+    if(Memo) TheFunction = CodegenMemo(S, TheFunction);
+    if(Tier) {
+      TheFunction = S.CodegenTier1(TheFunction, Tier);
+      S.Profile = 0;
+    }
     return TheFunction;
   }
 
   TheFunction->eraseFromParent();
+  if(Tier) {
+    delete Tier;
+    S.Profile = 0;
+  }
   return 0;
 }
 
 
+// Batch evaluation
+
+// Emits RowF.batch into the open module: a private copy of RowF inlined
+// into a counted loop over the columns. The loop has an integer induction
+// variable and no calls, so the loop vectorizer widens it to the target's
+// vector width and emits the scalar remainder loop.
+Function *Session::CodegenBatchKernel(Function *RowF) {
+  LLVMContext &C = Context;
+  // Restored snapshot modules read function bodies on demand.
+  std::string ErrStr;
+  if(RowF->Materialize(&ErrStr)) return ErrorF(ErrStr.c_str());
+  Module *M = JITHelper->getModuleForNewFunction();
+
+  Function *Row = CloneDefinitionInto(RowF, M, RowF->getName() + ".row", Function::InternalLinkage);
+
+  Type *Int64Ty = Type::getInt64Ty(C);
+  Type *DoublePtrTy = Type::getDoublePtrTy(C);
+  Type *Params[] = { DoublePtrTy, PointerType::getUnqual(DoublePtrTy), Int64Ty };
+  FunctionType *KT = FunctionType::get(Type::getVoidTy(C), Params, false);
+  Function *K = Function::Create(KT, Function::ExternalLinkage, RowF->getName() + ".batch", M);
+
+  Function::arg_iterator AI = K->arg_begin();
+  Value *Out = AI++;
+  Value *Cols = AI++;
+  Value *N = AI;
+  Out->setName("out");
+  Cols->setName("cols");
+  N->setName("n");
+
+  BasicBlock *EntryBB = BasicBlock::Create(C, "entry", K);
+  BasicBlock *PreheaderBB = BasicBlock::Create(C, "preheader", K);
+  BasicBlock *LoopBB = BasicBlock::Create(C, "loop", K);
+  BasicBlock *ExitBB = BasicBlock::Create(C, "loopexit", K);
+  BasicBlock *RetBB = BasicBlock::Create(C, "ret", K);
+
+  IRBuilder<> B(EntryBB);
+  std::vector<Value*> ColPtrs;
+  for(unsigned i = 0, e = Row->arg_size(); i != e; ++i) {
+    ColPtrs.push_back(B.CreateLoad(B.CreateConstGEP1_32(Cols, i), "col"));
+  }
+  B.CreateCondBr(B.CreateICmpSGT(N, B.getInt64(0), "nonempty"), PreheaderBB, RetBB);
+
+  B.SetInsertPoint(PreheaderBB);
+  B.CreateBr(LoopBB);
+
+  B.SetInsertPoint(LoopBB);
+  PHINode *I = B.CreatePHI(Int64Ty, 2, "i");
+  I->addIncoming(B.getInt64(0), PreheaderBB);
+  std::vector<Value*> RowArgs;
+  for(unsigned i = 0, e = ColPtrs.size(); i != e; ++i) {
+    RowArgs.push_back(B.CreateLoad(B.CreateGEP(ColPtrs[i], I), "arg"));
+  }
+  CallInst *Call = B.CreateCall(Row, RowArgs, "row");
+  B.CreateStore(Call, B.CreateGEP(Out, I));
+  Value *Next = B.CreateAdd(I, B.getInt64(1), "i.next", true, true);
+  I->addIncoming(Next, LoopBB);
+  B.CreateCondBr(B.CreateICmpSLT(Next, N, "loopcond"), LoopBB, ExitBB);
+
+  B.SetInsertPoint(ExitBB);
+  B.CreateBr(RetBB);
+
+  B.SetInsertPoint(RetBB);
+  B.CreateRetVoid();
+
+  InlineFunctionInfo IFI;
+  InlineFunction(Call, IFI);
+  if(Row->use_empty()) Row->eraseFromParent();
+
+  verifyFunction(*K);
+  return K;
+}
+
+// Host API: compiles (once) and returns a columnar kernel for the scalar
+// def FnName, whose parameters must all be numbers.
+BatchKernelFn Session::getBatchKernel(const std::string &FnName) {
+  std::string KernelName = MakeLegalFunctionName(FnName) + ".batch";
+  if(void *P = JITHelper->getSymbolAddress(KernelName)) return (BatchKernelFn)(intptr_t)P;
+
+  Function *RowF = JITHelper->getDefinition(MakeLegalFunctionName(FnName));
+  if(RowF == 0) {
+    ErrorF("Unknown function referenced");
+    return 0;
+  }
+  for(Function::arg_iterator AI = RowF->arg_begin(); AI != RowF->arg_end(); ++AI) {
+    if(!AI->getType()->isDoubleTy()) {
+      ErrorF("batch kernels need a function of numbers only");
+      return 0;
+    }
+  }
+
+  Function *K = CodegenBatchKernel(RowF);
+  return (BatchKernelFn)(intptr_t)JITHelper->getPointerToFunction(K);
+}
+
 // Top-Level parsing
 
-static void HandleDefinition() {
-  if(FunctionAST *F = ParseDefinition()) {
-    if(Function *LF = F->Codegen()) {
+void Session::HandleDefinition(Parser &P) {
+  if(FunctionAST *F = P.ParseDefinition()) {
+    if(Function *LF = F->Codegen(*this)) {
       fprintf(stderr, "Read a function definition: ");
       LF->dump();
     }
   } else {
-    getNextToken();
+    P.getNextToken();
   }
 }
 
-static void HandleExtern() {
-  if(PrototypeAST *P = ParseExtern()) {
-    if(Function *F = P->Codegen()) {
+void Session::HandleExtern(Parser &P) {
+  if(PrototypeAST *Proto = P.ParseExtern()) {
+    if(Function *F = Proto->Codegen(*this)) {
       fprintf(stderr, "Read an extern: ");
       F->dump();
     }
   } else {
-    getNextToken();
+    P.getNextToken();
   }
 }
 
-static void HandleTopLevelExpression() {
-  if(FunctionAST *F = ParseTopLevelExpr()) {
-    if(Function *LF = F->Codegen()) {
+void Session::HandleTopLevelExpression(Parser &P) {
+  if(FunctionAST *F = P.ParseTopLevelExpr()) {
+    if(Function *LF = F->Codegen(*this)) {
       void *FPtr = JITHelper->getPointerToFunction(LF);
+      if(!FPtr) return;
       double (*FP)() = (double (*)())(intptr_t)FPtr;
       fprintf(stderr, "Evaluated to %f\n", FP());
     }
   } else {
-    getNextToken();
+    P.getNextToken();
   }
 }
 
-static void MainLoop() {
+void Session::run(Lexer &L) {
+  Parser P(L, BinopPrecedence, Errors);
+  P.getNextToken();
+
   while(1) {
     fprintf(stderr, "ready> ");
-    switch(CurTok) {
+    switch(P.CurTok) {
     case tok_eof: return;
-    case ';': getNextToken(); break;
-    case tok_def: HandleDefinition(); break;
-    case tok_extern: HandleExtern(); break;
-    default: HandleTopLevelExpression(); break;
+    case ';': P.getNextToken(); break;
+    case tok_def: case tok_memo: HandleDefinition(P); break;
+    case tok_extern: HandleExtern(P); break;
+    default: HandleTopLevelExpression(P); break;
     }
   }
 }
 
-//Lib
+// Batch mode
+
+// Names the body calls, and the number of AST nodes it has.
+static void collectCalls(ExprAST *Body, std::set<std::string> &Callees, unsigned &Nodes) {
+  std::vector<ExprAST*> Work(1, Body);
+  while(!Work.empty()) {
+    ExprAST *E = Work.back();
+    Work.pop_back();
+    E->getChildren(Work);
+    ++Nodes;
+    if(CallExprAST *C = dyn_cast<CallExprAST>(E)) Callees.insert(C->getCallee());
+  }
+}
 
-extern "C"
-double putchard(double x) {
-  putchar((char)x);
+// Splits [B, E) into at most N chunks, each starting at a top-level item,
+// and returns the chunk starts followed by E. Items are found by a line
+// whose first word is def, memo or extern: comments end with their line, so
+// a line start is never inside one.
+static std::vector<const char *> findItemBoundaries(const char *B, const char *E, unsigned N) {
+  std::vector<const char *> Starts(1, B);
+  for(unsigned i = 1; i < N; ++i) {
+    const char *P = std::max(B + (E - B) / N * i, Starts.back());
+    while(P != E) {
+      P = scanClass(P, E, CC_Newline, false);
+      P = scanClass(P, E, CC_Space, true);
+      StringRef Word(P, scanClass(P, E, CC_Alpha | CC_Digit, true) - P);
+      if(Word == "def" || Word == "memo" || Word == "extern") break;
+    }
+    if(P == E) break;
+    if(P != Starts.back()) Starts.push_back(P);
+  }
+  Starts.push_back(E);
+  return Starts;
+}
+
+// Parses the top-level items of Source in order. A large input is cut at
+// item boundaries and the chunks are parsed on their own threads, each into
+// its own arena; errors are reported in source order afterwards. Returns
+// the number of threads used.
+unsigned Session::parseItems(StringRef Source, std::vector<std::pair<FunctionAST *, PrototypeAST *> > &Items) {
+  unsigned Threads = ParseThreads ? ParseThreads : std::max(1u, std::thread::hardware_concurrency());
+  // Below this a thread costs more than it saves.
+  const size_t MinChunk = 256 * 1024;
+  Threads = std::min<size_t>(Threads, Source.size() / MinChunk + 1);
+  std::vector<const char *> Starts = findItemBoundaries(Source.begin(), Source.end(), Threads);
+  unsigned NumChunks = Starts.size() - 1;
+
+  std::vector<std::vector<std::pair<FunctionAST *, PrototypeAST *> > > ChunkItems(NumChunks);
+  std::vector<ErrorLog> Logs(NumChunks);
+  size_t FirstArena = ParseArenas.size();
+  for(unsigned i = 0; i != NumChunks; ++i) ParseArenas.emplace_back(new BumpPtrAllocator);
+
+  auto ParseChunk = [&](unsigned i) {
+    Logs[i].Defer = true;
+    Lexer L(Starts[i], Starts[i + 1]);
+    Parser P(L, BinopPrecedence, Logs[i], ParseArenas[FirstArena + i].get());
+    P.getNextToken();
+    while(P.CurTok != tok_eof) {
+      FunctionAST *F = 0;
+      PrototypeAST *Proto = 0;
+      switch(P.CurTok) {
+      case ';': P.getNextToken(); continue;
+      case tok_def: case tok_memo: F = P.ParseDefinition(); break;
+      case tok_extern: Proto = P.ParseExtern(); break;
+      default: F = P.ParseTopLevelExpr(); break;
+      }
+      if(F || Proto) ChunkItems[i].push_back(std::make_pair(F, Proto));
+      else P.getNextToken();
+    }
+  };
+  std::vector<std::thread> Workers;
+  for(unsigned i = 1; i < NumChunks; ++i) Workers.push_back(std::thread(ParseChunk, i));
+  ParseChunk(0);
+  for(unsigned i = 0; i != Workers.size(); ++i) Workers[i].join();
+
+  for(unsigned i = 0; i != NumChunks; ++i) {
+    Items.insert(Items.end(), ChunkItems[i].begin(), ChunkItems[i].end());
+    for(unsigned j = 0; j != Logs[i].Deferred.size(); ++j) Errors.report(Logs[i].Deferred[j]);
+  }
+  return NumChunks;
+}
+
+// Parses all of the input before compiling any of it, so only the defs
+// reachable from a top-level expression or from Roots are compiled. The
+// call graph spans the whole input: a def may be called from an expression
+// that comes after it. Skipped defs are reported with an estimate of the
+// compile time and code they would have cost, scaled by AST size from what
+// was compiled.
+void Session::runBatch(StringRef Source, const std::vector<std::string> &Roots, bool KeepAllDefs) {
+  typedef std::chrono::steady_clock Clock;
+
+  // In source order; an item has either a def/expression or an extern.
+  std::vector<std::pair<FunctionAST *, PrototypeAST *> > Items;
+  Clock::time_point ParseStart = Clock::now();
+  unsigned Threads = parseItems(Source, Items);
+  fprintf(stderr, "batch: parsed %zu items in %.1f ms on %u thread%s\n", Items.size(),
+          std::chrono::duration<double, std::milli>(Clock::now() - ParseStart).count(),
+          Threads, Threads == 1 ? "" : "s");
+
+  // The call graph, with the nodes of each def; a redefinition's edges are
+  // merged in, as it will be compiled (and rejected) only if reachable.
+  std::map<std::string, std::set<std::string> > Calls;
+  std::map<std::string, unsigned> Nodes;
+  std::vector<std::string> Work(Roots);
+  for(unsigned i = 0, e = Items.size(); i != e; ++i) {
+    FunctionAST *F = Items[i].first;
+    if(!F) continue;
+    const std::string &Name = F->getProto()->getName();
+    collectCalls(F->getBody(), Calls[Name], Nodes[Name]);
+    if(Name.empty() || KeepAllDefs) Work.push_back(Name);
+  }
+  std::set<std::string> Reachable;
+  while(!Work.empty()) {
+    std::string Name = Work.back();
+    Work.pop_back();
+    if(!Reachable.insert(Name).second) continue;
+    std::set<std::string> &Callees = Calls[Name];
+    Work.insert(Work.end(), Callees.begin(), Callees.end());
+  }
+
+  Clock::duration CompileTime = Clock::duration::zero();
+  unsigned NumDefs = 0, NumSkipped = 0, CompiledNodes = 0, SkippedNodes = 0;
+  for(unsigned i = 0, e = Items.size(); i != e; ++i) {
+    if(PrototypeAST *Proto = Items[i].second) {
+      Proto->Codegen(*this);
+      continue;
+    }
+    FunctionAST *F = Items[i].first;
+    const std::string &Name = F->getProto()->getName();
+    if(!Name.empty()) {
+      ++NumDefs;
+      if(!Reachable.count(Name)) {
+        ++NumSkipped;
+        SkippedNodes += Nodes[Name];
+        continue;
+      }
+    }
+    CompiledNodes += Nodes[Name];
+
+    Clock::time_point Start = Clock::now();
+    Function *LF = F->Codegen(*this);
+    void *FPtr = LF && Name.empty() ? JITHelper->getPointerToFunction(LF) : 0;
+    CompileTime += Clock::now() - Start;
+    if(FPtr) printf("%f\n", ((double (*)())(intptr_t)FPtr)());
+  }
+
+  double Ms = std::chrono::duration<double, std::milli>(CompileTime).count();
+  fprintf(stderr, "batch: compiled %u of %u defs in %.1f ms, %zu bytes of code\n",
+          NumDefs - NumSkipped, NumDefs, Ms, JITHelper->getObjectBytes());
+  if(NumSkipped && CompiledNodes) {
+    double Scale = (double)SkippedNodes / CompiledNodes;
+    fprintf(stderr, "batch: skipped %u unreachable defs (%u AST nodes), saving about %.1f ms "
+            "and %.0f bytes\n", NumSkipped, SkippedNodes, Ms * Scale, JITHelper->getObjectBytes() * Scale);
+  }
+}
+
+// Watch mode
+
+// Source text with comments dropped and whitespace runs collapsed, so that
+// reformatting an item or its comments does not count as a change.
+static std::string normalizeSource(const char *B, const char *E) {
+  std::string Out;
+  for(; B != E; ++B) {
+    if(*B == '#') {
+      while(B + 1 != E && B[1] != '\n' && B[1] != '\r') ++B;
+    } else if(isspace((unsigned char)*B)) {
+      if(!Out.empty() && Out.back() != ' ') Out += ' ';
+    } else {
+      Out += *B;
+    }
+  }
+  if(!Out.empty() && Out.back() == ' ') Out.pop_back();
+  return Out;
+}
+
+// Runs Path, then each time it is saved reruns only what changed. Top-level
+// items are matched by a hash of their source. A changed def is compiled
+// again under its next symbol version, and so is every def that calls it,
+// directly or not; all other defs keep the code compiled for them before.
+// An expression is evaluated again when it is new or calls a recompiled def;
+// repeats of the same expression count as different ones.
+int Session::watch(const std::string &Path) {
+  typedef std::chrono::steady_clock Clock;
+  std::map<std::string, size_t> Compiled;
+  std::set<std::pair<size_t, unsigned> > Evaluated;
+  size_t LastFileHash = 0;
+  struct timespec LastModified = { 0, 0 };
+  bool First = true;
+
+  while(1) {
+    struct stat St;
+    bool Exists = stat(Path.c_str(), &St) == 0;
+    if(!First && (!Exists || (St.st_mtim.tv_sec == LastModified.tv_sec &&
+                              St.st_mtim.tv_nsec == LastModified.tv_nsec))) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      continue;
+    }
+    if(Exists) LastModified = St.st_mtim;
+
+    ErrorOr<std::unique_ptr<MemoryBuffer> > File = MemoryBuffer::getFile(Path, -1, false);
+    if(!File) {
+      fprintf(stderr, "Cannot read '%s': %s\n", Path.c_str(), File.getError().message().c_str());
+      if(First) return 1;
+      continue;
+    }
+    // Editors may rewrite the file in place; work on a copy.
+    std::string Source = (*File)->getBuffer().str();
+    size_t FileHash = std::hash<std::string>()(Source);
+    if(!First && FileHash == LastFileHash) continue;
+    LastFileHash = FileHash;
+    First = false;
+    Clock::time_point Start = Clock::now();
+
+    struct Item {
+      FunctionAST *F;
+      PrototypeAST *Proto;
+      size_t Hash;
+      std::set<std::string> Callees;
+    };
+    std::vector<Item> Items;
+    Lexer L(Source.data(), Source.data() + Source.size());
+    Parser P(L, BinopPrecedence, Errors);
+    P.getNextToken();
+    while(P.CurTok != tok_eof) {
+      if(P.CurTok == ';') {
+        P.getNextToken();
+        continue;
+      }
+      const char *ItemStart = L.getTokStart();
+      Item I;
+      I.F = 0;
+      I.Proto = 0;
+      switch(P.CurTok) {
+      case tok_def: case tok_memo: I.F = P.ParseDefinition(); break;
+      case tok_extern: I.Proto = P.ParseExtern(); break;
+      default: I.F = P.ParseTopLevelExpr(); break;
+      }
+      if(!I.F && !I.Proto) {
+        P.getNextToken();
+        continue;
+      }
+      I.Hash = std::hash<std::string>()(normalizeSource(ItemStart, L.getTokStart()));
+      if(I.F) {
+        unsigned Nodes = 0;
+        collectCalls(I.F->getBody(), I.Callees, Nodes);
+      }
+      Items.push_back(I);
+    }
+
+    // Defs whose source changed, plus everything that can reach them.
+    std::map<std::string, std::vector<std::string> > Callers;
+    std::set<std::string> Dirty, InFile;
+    for(unsigned i = 0, e = Items.size(); i != e; ++i) {
+      if(!Items[i].F || Items[i].F->getProto()->getName().empty()) continue;
+      const std::string &Name = Items[i].F->getProto()->getName();
+      InFile.insert(Name);
+      std::set<std::string> &Callees = Items[i].Callees;
+      for(std::set<std::string>::iterator CI = Callees.begin(); CI != Callees.end(); ++CI) {
+        Callers[*CI].push_back(Name);
+      }
+      std::map<std::string, size_t>::iterator it = Compiled.find(Name);
+      if(it == Compiled.end() || it->second != Items[i].Hash) Dirty.insert(Name);
+    }
+    // A deleted def's code stays loaded; moving its name to an undefined
+    // version makes callers that remain fail to compile instead.
+    for(std::map<std::string, size_t>::iterator it = Compiled.begin(); it != Compiled.end();) {
+      if(InFile.count(it->first)) {
+        ++it;
+        continue;
+      }
+      Dirty.insert(it->first);
+      ++DefVersions[it->first];
+      Compiled.erase(it++);
+    }
+    std::vector<std::string> Work(Dirty.begin(), Dirty.end());
+    while(!Work.empty()) {
+      std::vector<std::string> &Up = Callers[Work.back()];
+      Work.pop_back();
+      for(unsigned i = 0, e = Up.size(); i != e; ++i) {
+        if(Dirty.insert(Up[i]).second) Work.push_back(Up[i]);
+      }
+    }
+    // Versions are assigned up front, so that externs and calls to defs
+    // further down the file already use the new symbols.
+    for(std::set<std::string>::iterator it = Dirty.begin(); it != Dirty.end(); ++it) {
+      if(!InFile.count(*it)) continue;
+      std::map<std::string, unsigned>::iterator V = DefVersions.find(*it);
+      if(V != DefVersions.end()) ++V->second;
+      else DefVersions[*it] = 0;
+    }
+    // Callers compiled before their changed callee must not see its old
+    // effects; a def with none recorded is assumed to write memory.
+    for(std::set<std::string>::iterator it = Dirty.begin(); it != Dirty.end(); ++it) {
+      DefEffects.erase(*it);
+    }
+
+    std::map<size_t, unsigned> Occurrences;
+    unsigned NumDefs = 0, NumCompiled = 0;
+    for(unsigned i = 0, e = Items.size(); i != e; ++i) {
+      if(PrototypeAST *Proto = Items[i].Proto) {
+        Proto->Codegen(*this);
+        continue;
+      }
+      FunctionAST *F = Items[i].F;
+      const std::string &Name = F->getProto()->getName();
+      if(!Name.empty()) {
+        ++NumDefs;
+        if(!Dirty.count(Name)) continue;
+        ++NumCompiled;
+        if(F->Codegen(*this)) Compiled[Name] = Items[i].Hash;
+        else Compiled.erase(Name);
+        continue;
+      }
+
+      unsigned Occurrence = Occurrences[Items[i].Hash]++;
+      bool Rerun = Evaluated.insert(std::make_pair(Items[i].Hash, Occurrence)).second;
+      std::set<std::string> &Callees = Items[i].Callees;
+      for(std::set<std::string>::iterator it = Callees.begin(); it != Callees.end() && !Rerun; ++it) {
+        Rerun = Dirty.count(*it);
+      }
+      if(!Rerun) continue;
+      if(Function *LF = F->Codegen(*this)) {
+        if(void *FPtr = JITHelper->getPointerToFunction(LF)) {
+          fprintf(stderr, "Evaluated to %f\n", ((double (*)())(intptr_t)FPtr)());
+        }
+      }
+    }
+    fprintf(stderr, "watch: recompiled %u of %u defs in %.1f ms\n", NumCompiled, NumDefs,
+            std::chrono::duration<double, std::milli>(Clock::now() - Start).count());
+  }
+}
+
+// Lexes Path from memory and then through a stdio stream, the REPL's path,
+// and prints the throughput of each.
+static int lexBench(const std::string &Path) {
+  typedef std::chrono::steady_clock Clock;
+  ErrorOr<std::unique_ptr<MemoryBuffer> > File = MemoryBuffer::getFile(Path, -1, false);
+  if(!File) {
+    fprintf(stderr, "Cannot read '%s': %s\n", Path.c_str(), File.getError().message().c_str());
+    return 1;
+  }
+  StringRef Source = (*File)->getBuffer();
+
+  for(int Stream = 0; Stream != 2; ++Stream) {
+    FILE *In = Stream ? fmemopen((void *)Source.data(), Source.size(), "r") : 0;
+    Lexer L = Stream ? Lexer(In) : Lexer(Source.begin(), Source.end());
+    size_t Tokens = 0;
+    Clock::time_point Start = Clock::now();
+    while(L.gettok() != tok_eof) ++Tokens;
+    double Seconds = std::chrono::duration<double>(Clock::now() - Start).count();
+    if(In) fclose(In);
+    printf("%-6s %zu bytes, %zu tokens in %.3f s: %.0f MB/s\n", Stream ? "stream" : "buffer",
+           Source.size(), Tokens, Seconds, Source.size() / Seconds / 1e6);
+  }
   return 0;
 }
 
-// Main
+// Parses a million generated literals with parseNumber and with the copy
+// into a std::string and strtod that the lexer used before, checks that the
+// result of each literal agrees bit for bit, and prints the time per literal
+// of each. Short literals, decimal and hex, take the fast path; 17-digit,
+// extreme and over-long hex ones go to strtod.
+static int numberBench() {
+  typedef std::chrono::steady_clock Clock;
+  std::string Source;
+  std::vector<std::pair<size_t, size_t> > Spans[2];
+  uint64_t Seed = 88172645463325252ULL;
+  char Buf[64];
+  for(unsigned i = 0; i != 1000000; ++i) {
+    Seed ^= Seed << 13;
+    Seed ^= Seed >> 7;
+    Seed ^= Seed << 17;
+    switch(i % 6) {
+    case 0: snprintf(Buf, sizeof(Buf), "%u", (unsigned)(Seed % 100000)); break;
+    case 1: snprintf(Buf, sizeof(Buf), "%u.%03ue-%u", (unsigned)(Seed % 1000), (unsigned)(Seed >> 32) % 1000,
+                     (unsigned)(Seed >> 48) % 8); break;
+    case 2: snprintf(Buf, sizeof(Buf), "%a", (double)(Seed % 100000) / 16); break;
+    case 3: snprintf(Buf, sizeof(Buf), "%.17g", (double)(Seed >> 11) / (1ULL << 40)); break;
+    case 4: snprintf(Buf, sizeof(Buf), "%.6e", (double)(Seed >> 11) * 1e-300); break;
+    case 5: snprintf(Buf, sizeof(Buf), "0x%llx.%llxp-%u", (unsigned long long)Seed, (unsigned long long)(Seed * 31),
+                     (unsigned)(Seed >> 48) % 1100); break;
+    }
+    Spans[i % 6 >= 3].push_back(std::make_pair(Source.size(), strlen(Buf)));
+    Source += Buf;
+    Source += ' ';
+  }
+
+  for(int Long = 0; Long != 2; ++Long) {
+    const std::vector<std::pair<size_t, size_t> > &S = Spans[Long];
+    std::vector<double> Vals[2] = { std::vector<double>(S.size()), std::vector<double>(S.size()) };
+    for(int Fast = 0; Fast != 2; ++Fast) {
+      Clock::time_point Start = Clock::now();
+      for(size_t i = 0, e = S.size(); i != e; ++i) {
+        const char *B = Source.data() + S[i].first, *E = B + S[i].second;
+        if(!Fast) Vals[0][i] = strtod(std::string(B, E).c_str(), 0);
+        else if(parseNumber(B, E, Vals[1][i]) != E) Vals[1][i] = NAN;
+      }
+      double Ns = std::chrono::duration<double, std::nano>(Clock::now() - Start).count() / S.size();
+      printf("%-5s %-11s %.1f ns/literal\n", Long ? "long" : "short", Fast ? "parseNumber" : "strtod", Ns);
+    }
+    for(size_t i = 0, e = S.size(); i != e; ++i) {
+      if(memcmp(&Vals[0][i], &Vals[1][i], sizeof(double))) {
+        printf("results differ for %.*s: %a, strtod gives %a\n", (int)S[i].second, Source.data() + S[i].first,
+               Vals[1][i], Vals[0][i]);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
 
+// Evaluates FnName over Rows generated rows with its columnar kernel and
+// with one call per row through an entry point, checks that the results
+// agree bit for bit, and prints the time per row of each.
+static int kernelBench(Session &S, const std::string &FnName, unsigned Rows) {
+  typedef std::chrono::steady_clock Clock;
+  BatchKernelFn Kernel = S.getBatchKernel(FnName);
+  if(!Kernel) return 1;
+  unsigned NumArgs = S.JITHelper->getDefinition(MakeLegalFunctionName(FnName))->arg_size();
+
+  std::string Params, Args;
+  for(unsigned j = 0; j != NumArgs; ++j) {
+    Params += " x" + std::to_string(j);
+    Args += (j ? ", x" : "x") + std::to_string(j);
+  }
+  unsigned RefArgs;
+  std::string RefName;
+  EntryFn Ref = S.compileEntry("def kernelbenchref(" + Params + ") " + FnName + "(" + Args + ")", RefArgs, RefName);
+  if(!Ref) return 1;
+
+  std::vector<std::vector<double> > Cols(NumArgs, std::vector<double>(Rows));
+  std::vector<double *> ColPtrs;
+  uint64_t Seed = 88172645463325252ULL;
+  for(unsigned j = 0; j != NumArgs; ++j) {
+    for(unsigned i = 0; i != Rows; ++i) {
+      Seed ^= Seed << 13;
+      Seed ^= Seed >> 7;
+      Seed ^= Seed << 17;
+      Cols[j][i] = (double)(Seed >> 11) / (1ULL << 51);
+    }
+    ColPtrs.push_back(Cols[j].data());
+  }
 
-int main() {
-  InitializeNativeTarget();
-  InitializeNativeTargetAsmPrinter();
-  InitializeNativeTargetAsmParser();
+  std::vector<double> Out(Rows), RefOut(Rows), Row(NumArgs);
+  Clock::time_point Start = Clock::now();
+  Kernel(Out.data(), ColPtrs.data(), Rows);
+  double KernelNs = std::chrono::duration<double, std::nano>(Clock::now() - Start).count() / Rows;
+
+  Start = Clock::now();
+  for(unsigned i = 0; i != Rows; ++i) {
+    for(unsigned j = 0; j != NumArgs; ++j) Row[j] = Cols[j][i];
+    RefOut[i] = Ref(Row.data());
+  }
+  double RefNs = std::chrono::duration<double, std::nano>(Clock::now() - Start).count() / Rows;
+
+  printf("%s over %u rows: kernel %.2f ns/row, per-row calls %.2f ns/row\n", FnName.c_str(), Rows, KernelNs, RefNs);
+  unsigned Differ = 0;
+  for(unsigned i = 0; i != Rows; ++i) Differ += memcmp(&Out[i], &RefOut[i], sizeof(double)) != 0;
+  if(Differ) {
+    printf("%u rows differ\n", Differ);
+    return 1;
+  }
+  return 0;
+}
+
+// Embedding
+
+// Compiles the defs and externs in Source without evaluating anything.
+bool Session::addDefinitions(const std::string &Source) {
+  Lexer L(Source.data(), Source.data() + Source.size());
+  Parser P(L, BinopPrecedence, Errors);
+  P.getNextToken();
+
+  while(1) {
+    switch(P.CurTok) {
+    case tok_eof: return true;
+    case ';': P.getNextToken(); break;
+    case tok_def:
+    case tok_memo: {
+      FunctionAST *F = P.ParseDefinition();
+      if(!F || !F->Codegen(*this)) return false;
+      break;
+    }
+    case tok_extern: {
+      PrototypeAST *Proto = P.ParseExtern();
+      if(!Proto || !Proto->Codegen(*this)) return false;
+      break;
+    }
+    default:
+      Errors.report("expected a definition or extern");
+      return false;
+    }
+  }
+}
+
+// double F.entry(const double *Args) { return F(Args[0], ..., Args[n-1]); }
+Function *Session::CodegenEntry(Function *F) {
+  for(Function::arg_iterator AI = F->arg_begin(); AI != F->arg_end(); ++AI) {
+    if(!AI->getType()->isDoubleTy()) return ErrorF("entry points need a function of numbers only");
+  }
+
+  Type *ArgsTy = Type::getDoublePtrTy(Context);
+  FunctionType *FT = FunctionType::get(Type::getDoubleTy(Context), ArgsTy, false);
+  Function *Entry = Function::Create(FT, Function::ExternalLinkage, F->getName() + ".entry", F->getParent());
+  Value *Args = Entry->arg_begin();
+  Args->setName("args");
+
+  IRBuilder<> B(BasicBlock::Create(Context, "entry", Entry));
+  std::vector<Value*> CallArgs;
+  for(unsigned i = 0, e = F->arg_size(); i != e; ++i) {
+    CallArgs.push_back(B.CreateLoad(B.CreateConstGEP1_32(Args, i), "arg"));
+  }
+  B.CreateRet(B.CreateCall(F, CallArgs, "calltmp"));
+
+  verifyFunction(*Entry);
+  return Entry;
+}
+
+// Compiles Source, a single def or top-level expression, and returns its
+// entry point. For a def, DefName is set to the defined function; EntryF,
+// if given, to the entry function.
+EntryFn Session::compileEntry(const std::string &Source, unsigned &NumArgs, std::string &DefName, Function **EntryF) {
+  Lexer L(Source.data(), Source.data() + Source.size());
+  Parser P(L, BinopPrecedence, Errors);
+  P.getNextToken();
+  while(P.CurTok == ';') P.getNextToken();
+
+  bool IsDef = P.CurTok == tok_def || P.CurTok == tok_memo;
+  FunctionAST *AST = IsDef ? P.ParseDefinition() : P.ParseTopLevelExpr();
+  if(!AST) return 0;
+
+  while(P.CurTok == ';') P.getNextToken();
+  if(P.CurTok != tok_eof) {
+    Errors.report("expected a single definition or expression");
+    return 0;
+  }
+
+  Function *F = AST->Codegen(*this);
+  if(!F) return 0;
+
+  Function *Entry = CodegenEntry(F);
+  if(!Entry) return 0;
+
+  if(IsDef) DefName = F->getName();
+  if(EntryF) *EntryF = Entry;
+  NumArgs = F->arg_size();
+  return (EntryFn)(intptr_t)JITHelper->getPointerToFunction(Entry);
+}
+
+// Shared code cache
+
+// An immutable, refcounted handle to compiled code. It keeps the session
+// owning the machine code alive, so it stays callable, from any number of
+// threads at once, for as long as someone holds it.
+class CompiledFunction {
+public:
+  CompiledFunction(EntryFn entry, unsigned numArgs, const std::shared_ptr<Session> &owner)
+    : Entry(entry), NumArgs(numArgs), Owner(owner) {}
+
+  double operator()(const double *Args) const { return Entry(Args); }
+  unsigned getNumArgs() const { return NumArgs; }
+
+private:
+  EntryFn Entry;
+  unsigned NumArgs;
+  std::shared_ptr<Session> Owner;
+};
+
+typedef std::shared_ptr<const CompiledFunction> FunctionHandle;
+
+// Maps source text to compiled handles for any number of threads.
+//
+// Lookups are lock-free: buckets are insert-only lists of immutable
+// entries published with release stores. Compiles run on the calling
+// thread in a per-thread session, so threads compile in parallel; a
+// thread racing on source that is already being compiled waits for that
+// result instead. Definitions are shared: each worker session replays the
+// defs other threads added before it compiles. Worker sessions are
+// thread_local, so a thread that exits takes its session with it once no
+// handle to code compiled there is left.
+class CodeCache {
+public:
+  CodeCache();
+  ~CodeCache();
+
+  FunctionHandle lookup(const std::string &Source) const;
+  FunctionHandle compile(const std::string &Source, std::string *ErrMsg = 0);
+  bool define(const std::string &Source, std::string *ErrMsg = 0);
+  void sync(Session &S, size_t &DefsSeen);
+
+private:
+  CodeCache(const CodeCache &) = delete;
+  void operator=(const CodeCache &) = delete;
+
+  struct Entry {
+    Entry(const std::string &source, const FunctionHandle &handle, Entry *next)
+      : Source(source), Handle(handle), Next(next) {}
+    const std::string Source;
+    const FunctionHandle Handle;
+    Entry *const Next;
+  };
+
+  struct Worker {
+    Worker() : Id(0), DefsSeen(0) {}
+    // Unique for the life of the process, unlike the session's address.
+    uint64_t Id;
+    std::shared_ptr<Session> S;
+    size_t DefsSeen;
+  };
+
+  static const unsigned NumBuckets = 4096;
+
+  std::atomic<Entry *> &getBucket(const std::string &Source) const {
+    return Buckets[std::hash<std::string>()(Source) % NumBuckets];
+  }
+  void publish(const std::string &Source, const FunctionHandle &H);
+  void sync(Session &S, size_t &DefsSeen, uint64_t Self);
+  Worker &getWorker();
+
+  const uint64_t Id;
+
+  mutable std::atomic<Entry *> Buckets[NumBuckets];
+
+  // Guards everything below; never held while compiling.
+  std::mutex Lock;
+  std::map<std::string, std::shared_future<FunctionHandle> > InFlight;
+  // Each source with the Id of the worker that added it.
+  std::vector<std::pair<std::string, uint64_t> > Definitions;
+};
+
+// Ids of caches and of their workers; 0 is no worker.
+static std::atomic<uint64_t> NextCodeCacheId(1);
+
+CodeCache::CodeCache() : Id(NextCodeCacheId++) {
+  for(unsigned i = 0; i != NumBuckets; ++i) Buckets[i].store(0, std::memory_order_relaxed);
+}
+
+CodeCache::~CodeCache() {
+  for(unsigned i = 0; i != NumBuckets; ++i) {
+    Entry *E = Buckets[i].load(std::memory_order_relaxed);
+    while(E) {
+      Entry *Next = E->Next;
+      delete E;
+      E = Next;
+    }
+  }
+}
+
+FunctionHandle CodeCache::lookup(const std::string &Source) const {
+  for(Entry *E = getBucket(Source).load(std::memory_order_acquire); E; E = E->Next) {
+    if(E->Source == Source) return E->Handle;
+  }
+  return FunctionHandle();
+}
+
+// Called with Lock held, so writers never race each other.
+void CodeCache::publish(const std::string &Source, const FunctionHandle &H) {
+  std::atomic<Entry *> &Bucket = getBucket(Source);
+  Bucket.store(new Entry(Source, H, Bucket.load(std::memory_order_relaxed)), std::memory_order_release);
+}
+
+// Replays into S the definitions added after the first DefsSeen, except
+// those S added itself. Sessions outside the cache can use this too.
+void CodeCache::sync(Session &S, size_t &DefsSeen) {
+  sync(S, DefsSeen, 0);
+}
+
+void CodeCache::sync(Session &S, size_t &DefsSeen, uint64_t Self) {
+  std::vector<std::string> Pending;
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    for(; DefsSeen != Definitions.size(); ++DefsSeen) {
+      if(Definitions[DefsSeen].second != Self) Pending.push_back(Definitions[DefsSeen].first);
+    }
+  }
+
+  // Failures here were already reported to whoever added the definition.
+  for(unsigned i = 0, e = Pending.size(); i != e; ++i) S.addDefinitions(Pending[i]);
+}
+
+// The calling thread's worker for this cache. Entries of caches destroyed
+// before the thread are only freed when it exits.
+CodeCache::Worker &CodeCache::getWorker() {
+  thread_local std::map<uint64_t, Worker> Workers;
+  Worker &W = Workers[Id];
+  if(!W.S) {
+    W.Id = NextCodeCacheId++;
+    W.S = std::make_shared<Session>();
+    W.S->Errors.Echo = false;
+  }
+  sync(*W.S, W.DefsSeen, W.Id);
+  return W;
+}
+
+FunctionHandle CodeCache::compile(const std::string &Source, std::string *ErrMsg) {
+  if(FunctionHandle H = lookup(Source)) return H;
+
+  std::promise<FunctionHandle> Promise;
+  {
+    std::unique_lock<std::mutex> Guard(Lock);
+    if(FunctionHandle H = lookup(Source)) return H;
+
+    std::map<std::string, std::shared_future<FunctionHandle> >::iterator it = InFlight.find(Source);
+    if(it != InFlight.end()) {
+      std::shared_future<FunctionHandle> Pending = it->second;
+      Guard.unlock();
+      FunctionHandle H = Pending.get();
+      if(!H && ErrMsg) *ErrMsg = "compilation failed in another thread";
+      return H;
+    }
+    InFlight[Source] = Promise.get_future().share();
+  }
+
+  Worker &W = getWorker();
+  std::shared_ptr<Session> S = W.S;
+  unsigned NumArgs = 0;
+  std::string DefName;
+  FunctionHandle H;
+  if(EntryFn Entry = S->compileEntry(Source, NumArgs, DefName)) {
+    H = std::make_shared<const CompiledFunction>(Entry, NumArgs, S);
+  } else if(ErrMsg) {
+    *ErrMsg = S->Errors.Last;
+  }
+
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if(H) {
+      if(!DefName.empty()) Definitions.push_back(std::make_pair(Source, W.Id));
+      publish(Source, H);
+    }
+    InFlight.erase(Source);
+  }
+  Promise.set_value(H);
+  return H;
+}
+
+// Adds defs and externs visible to every later compile, on any thread.
+bool CodeCache::define(const std::string &Source, std::string *ErrMsg) {
+  Worker &W = getWorker();
+  if(!W.S->addDefinitions(Source)) {
+    if(ErrMsg) *ErrMsg = W.S->Errors.Last;
+    return false;
+  }
+
+  std::lock_guard<std::mutex> Guard(Lock);
+  Definitions.push_back(std::make_pair(Source, W.Id));
+  return true;
+}
+
+// Tiered compilation
+
+// Promotes defs whose tier 1 code has been entered -hot-threshold times.
+// Tier 2 is compiled on a background thread in a private session, from
+// the retained AST, with the profile as branch weights, and then swapped
+// into the def's slot; running code is never blocked.
+class TieredCompiler {
+public:
+  TieredCompiler();
+  ~TieredCompiler();
+
+  void add(TierState *T);
+  bool isTiered(const std::string &Name);
+
+private:
+  void run();
+  bool promote(Session &P, TierState *T, const std::vector<TierState *> &All);
+
+  std::mutex Lock;
+  std::condition_variable Wake;
+  bool Stopping;
+  std::vector<std::unique_ptr<TierState> > States;
+  std::thread Worker;
+};
+
+TieredCompiler::TieredCompiler() : Stopping(false), Worker(&TieredCompiler::run, this) {}
+
+TieredCompiler::~TieredCompiler() {
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Stopping = true;
+  }
+  Wake.notify_one();
+  Worker.join();
+}
+
+void TieredCompiler::add(TierState *T) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  States.push_back(std::unique_ptr<TierState>(T));
+}
+
+bool TieredCompiler::isTiered(const std::string &Name) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  for(unsigned i = 0, e = States.size(); i != e; ++i) {
+    if(States[i]->Name == Name) return true;
+  }
+  return false;
+}
+
+void TieredCompiler::run() {
+  std::unique_ptr<Session> P;
+  std::unique_lock<std::mutex> Guard(Lock);
+  while(!Stopping) {
+    Wake.wait_for(Guard, std::chrono::milliseconds(10));
+
+    std::vector<TierState *> All;
+    for(unsigned i = 0, e = States.size(); i != e; ++i) All.push_back(States[i].get());
+    Guard.unlock();
+
+    for(unsigned i = 0, e = All.size(); i != e; ++i) {
+      TierState *T = All[i];
+      if(T->Promoted || !T->Slot.load(std::memory_order_acquire) || T->getCount(0) < HotThreshold) continue;
+      if(!P) {
+        P.reset(new Session());
+        P->Errors.Echo = false;
+      }
+      // Either way, never try again.
+      T->Promoted = true;
+      promote(*P, T, All);
+    }
+
+    Guard.lock();
+  }
+}
+
+// Gen(args) with Spec(args) taken instead when each argument in Fixed
+// has exactly the given bits.
+static Function *CodegenSpecializationGuard(Function *Gen, Function *Spec, const std::map<unsigned, uint64_t> &Fixed) {
+  LLVMContext &C = Gen->getContext();
+  Function *Dispatch = Function::Create(Gen->getFunctionType(), Function::ExternalLinkage, "", Gen->getParent());
+  BasicBlock *SpecBB = BasicBlock::Create(C, "spec", Dispatch);
+  BasicBlock *GenBB = BasicBlock::Create(C, "gen", Dispatch);
+  IRBuilder<> B(BasicBlock::Create(C, "entry", Dispatch, SpecBB));
+
+  std::vector<Value*> Args;
+  for(Function::arg_iterator AI = Dispatch->arg_begin(); AI != Dispatch->arg_end(); ++AI) Args.push_back(AI);
+
+  Value *Match = B.getTrue();
+  for(std::map<unsigned, uint64_t>::const_iterator it = Fixed.begin(); it != Fixed.end(); ++it) {
+    Value *Bits = B.CreateBitCast(Args[it->first], B.getInt64Ty());
+    Match = B.CreateAnd(Match, B.CreateICmpEQ(Bits, B.getInt64(it->second)), "match");
+  }
+  B.CreateCondBr(Match, SpecBB, GenBB);
+
+  B.SetInsertPoint(SpecBB);
+  CallInst *SpecCall = B.CreateCall(Spec, Args, "calltmp");
+  SpecCall->setTailCall();
+  B.CreateRet(SpecCall);
+
+  B.SetInsertPoint(GenBB);
+  CallInst *GenCall = B.CreateCall(Gen, Args, "calltmp");
+  GenCall->setTailCall();
+  B.CreateRet(GenCall);
+
+  Gen->setLinkage(Function::InternalLinkage);
+  Spec->setLinkage(Function::InternalLinkage);
+  verifyFunction(*Dispatch);
+  return Dispatch;
+}
+
+// Compiles T into its own module in P. T's hot callees are compiled into
+// the same module, internal and with inlinehint, so the inliner can use
+// them; every other def is called through its slot.
+bool TieredCompiler::promote(Session &P, TierState *T, const std::vector<TierState *> &All) {
+  std::vector<TierState *> Local(1, T);
+  for(unsigned i = 0, e = All.size(); i != e; ++i) {
+    if(All[i] != T && All[i]->getCount(0) >= HotThreshold &&
+       std::count(T->Callees.begin(), T->Callees.end(), All[i]->Name)) Local.push_back(All[i]);
+  }
+
+  P.SlotCalls.clear();
+  for(unsigned i = 0, e = All.size(); i != e; ++i) {
+    if(std::count(Local.begin(), Local.end(), All[i]) || !All[i]->Slot.load(std::memory_order_acquire)) continue;
+    P.SlotCalls[All[i]->Name] = All[i];
+    P.JITHelper->addBuiltin(All[i]->Name + ".slot", &All[i]->Slot);
+  }
+  for(unsigned i = 0, e = Local.size(); i != e; ++i) {
+    for(unsigned j = 0, je = Local[i]->Arrays.size(); j != je; ++j) {
+      P.JITHelper->shareArray(Local[i]->Arrays[j].first, Local[i]->Arrays[j].second);
+    }
+    for(unsigned j = 0, je = Local[i]->Externs.size(); j != je; ++j) Local[i]->Externs[j]->Codegen(P);
+  }
+
+  // Declare them all first, as they may call each other.
+  for(unsigned i = 0, e = Local.size(); i != e; ++i) Local[i]->AST->getProto()->Codegen(P);
 
-  LLVMContext &Context = getGlobalContext();
-  JITHelper = new MCJITHelper(Context);
+  std::vector<Function *> Fns;
+  for(unsigned i = 0, e = Local.size(); i != e; ++i) {
+    P.Profile = Local[i];
+    Function *F = Local[i]->AST->Codegen(P);
+    P.Profile = 0;
+    if(!F) break;
+    Fns.push_back(F);
+  }
+  if(Fns.size() != Local.size()) {
+    P.SlotCalls.clear();
+    return false;
+  }
+
+  for(unsigned i = 1, e = Fns.size(); i != e; ++i) {
+    Fns[i]->setLinkage(Function::InternalLinkage);
+    Fns[i]->addFnAttr(Attribute::InlineHint);
+  }
+
+  // Arguments that nearly always had the same value get a copy of T with
+  // the value folded in, behind a guard.
+  std::map<unsigned, uint64_t> Fixed;
+  uint64_t Entries = T->getCount(0);
+  for(unsigned i = 0, e = Fns[0]->arg_size(); SpecializePercent && i != e; ++i) {
+    if(!Fns[0]->getFunctionType()->getParamType(i)->isDoubleTy()) continue;
+    if(T->getCount(2 + 2 * i) * 100 >= Entries * SpecializePercent) Fixed[i] = T->getCount(1 + 2 * i);
+  }
+
+  Function *Entry = Fns[0];
+  if(!Fixed.empty()) {
+    Fns[0]->setName(T->Name + ".gen");
+    // Recursive calls in the copy may pass other values: back through the slot.
+    P.SlotCalls[T->Name] = T;
+    P.JITHelper->addBuiltin(T->Name + ".slot", &T->Slot);
+    for(std::map<unsigned, uint64_t>::iterator it = Fixed.begin(); it != Fixed.end(); ++it) {
+      double V;
+      memcpy(&V, &it->second, sizeof(V));
+      P.ArgConstants[it->first] = V;
+    }
+    P.Profile = T;
+    Function *Spec = T->AST->Codegen(P);
+    P.Profile = 0;
+    P.ArgConstants.clear();
+    if(Spec) {
+      Spec->setName(T->Name + ".spec");
+      Entry = CodegenSpecializationGuard(Fns[0], Spec, Fixed);
+    }
+  }
+  P.SlotCalls.clear();
+  Entry->setName(T->Name + ".t2");
 
+  void *Addr = P.JITHelper->getPointerToFunction(Entry);
+  if(!Addr) return false;
+  T->Slot.store(Addr, std::memory_order_release);
+  return true;
+}
+
+void Session::enableTiering() {
+  if(!Tiers) Tiers = new TieredCompiler();
+  Instrument = true;
+}
+
+// Renames the instrumented F to F.t1 and puts a trampoline under F's name
+// that calls through T's slot. Records what tier 2 will need to compile
+// F again elsewhere: the tiered defs it calls, its other callees as
+// externs, and the arrays its module uses.
+Function *Session::CodegenTier1(Function *F, TierState *T) {
+  Module *M = F->getParent();
+
+  std::set<std::string> Seen;
+  for(inst_iterator I = inst_begin(F), E = inst_end(F); I != E; ++I) {
+    CallInst *Call = dyn_cast<CallInst>(&*I);
+    Function *Callee = Call ? Call->getCalledFunction() : 0;
+    if(!Callee || Callee == F || Callee->isIntrinsic()) continue;
+    std::string Name = Callee->getName().str();
+    if(!Seen.insert(Name).second) continue;
+
+    if(Tiers->isTiered(Name)) {
+      T->Callees.push_back(Name);
+      continue;
+    }
+    FunctionType *FT = Callee->getFunctionType();
+    std::vector<std::string> ArgNames;
+    std::vector<bool> ArgIsArray;
+    for(unsigned i = 0, e = FT->getNumParams(); i != e; ++i) {
+      ArgNames.push_back("a" + std::to_string(i));
+      ArgIsArray.push_back(FT->getParamType(i)->isPointerTy());
+    }
+    T->Externs.push_back(new PrototypeAST(Name, ArgNames, ArgIsArray, true));
+  }
+  for(Module::global_iterator GI = M->global_begin(), GE = M->global_end(); GI != GE; ++GI) {
+    std::string Name = GI->getName().str();
+    if(GI->isDeclaration() && JITHelper->isBoundArray(Name)) {
+      T->Arrays.push_back(std::make_pair(Name, (KArray *)JITHelper->resolveSymbol(Name)));
+    }
+  }
+
+  T->NumCounters = NextCounter;
+  T->Counters.reset(new std::atomic<uint64_t>[NextCounter]());
+  JITHelper->addBuiltin(T->Name + ".prof", T->Counters.get());
+  JITHelper->addBuiltin(T->Name + ".slot", &T->Slot);
+
+  F->setName(T->Name + ".t1");
+  Function *Trampoline = Function::Create(F->getFunctionType(), Function::ExternalLinkage, T->Name, M);
+  IRBuilder<> B(BasicBlock::Create(Context, "entry", Trampoline));
+  Value *Slot = M->getOrInsertGlobal(T->Name + ".slot", F->getType());
+  std::vector<Value*> Args;
+  Function::arg_iterator FI = F->arg_begin();
+  for(Function::arg_iterator AI = Trampoline->arg_begin(); AI != Trampoline->arg_end(); ++AI, ++FI) {
+    AI->setName(FI->getName());
+    Args.push_back(AI);
+  }
+  CallInst *Call = B.CreateCall(B.CreateLoad(Slot, "impl"), Args, "calltmp");
+  Call->setTailCall();
+  B.CreateRet(Call);
+  verifyFunction(*Trampoline);
+
+  JITHelper->fillSlotOnCompile(T->Name + ".t1", &T->Slot);
+  Tiers->add(T);
+  return Trampoline;
+}
+
+// Inlines T's trampoline: load the slot and call it. A callee entered far
+// less often than the def being compiled gets a cold call site.
+Value *Session::CodegenSlotCall(TierState *T, FunctionType *FT, std::vector<Value*> &Args) {
+  Module *M = JITHelper->getModuleForNewFunction();
+  Value *Slot = M->getOrInsertGlobal(T->Name + ".slot", PointerType::getUnqual(FT));
+  CallInst *Call = Builder.CreateCall(Builder.CreateLoad(Slot, "impl"), Args, "calltmp");
+  if(Profile && T->getCount(0) * 100 < getCount(0)) {
+    Call->addAttribute(AttributeSet::FunctionIndex, Attribute::Cold);
+  }
+  return Call;
+}
+
+// The two counters of an if or for, allocated on its first emission.
+unsigned Session::getBranchCounters(ExprAST *E) {
+  std::map<ExprAST *, unsigned>::iterator it = BranchCounters.find(E);
+  if(it != BranchCounters.end()) return it->second;
+  unsigned Idx = NextCounter;
+  NextCounter += 2;
+  BranchCounters[E] = Idx;
+  return Idx;
+}
+
+// Tier 1 value profile: per scalar argument, the bits it had last time
+// and how often they repeated. Tier 2 only reserves the same counters.
+void Session::ProfileArguments(Function *F) {
+  unsigned Base = NextCounter;
+  NextCounter += 2 * F->arg_size();
+  if(!Profile || !Instrument) return;
+
+  Module *M = F->getParent();
+  Value *Counters = M->getOrInsertGlobal(Profile->Name + ".prof", Type::getInt64Ty(Context));
+  unsigned Idx = Base;
+  for(Function::arg_iterator AI = F->arg_begin(); AI != F->arg_end(); ++AI, Idx += 2) {
+    if(!AI->getType()->isDoubleTy()) continue;
+    Value *LastPtr = Builder.CreateConstGEP1_32(Counters, Idx);
+    Value *SamePtr = Builder.CreateConstGEP1_32(Counters, Idx + 1);
+    Value *Bits = Builder.CreateBitCast(AI, Builder.getInt64Ty(), "bits");
+    Value *Repeated = Builder.CreateICmpEQ(Bits, Builder.CreateLoad(LastPtr, "last"), "repeated");
+    Value *Same = Builder.CreateLoad(SamePtr, "same");
+    Builder.CreateStore(Builder.CreateAdd(Same, Builder.CreateZExt(Repeated, Builder.getInt64Ty()), "same"), SamePtr);
+    Builder.CreateStore(Bits, LastPtr);
+  }
+}
+
+void Session::CountEvent(unsigned Idx) {
+  if(!Profile || !Instrument) return;
+  Module *M = Builder.GetInsertBlock()->getParent()->getParent();
+  Value *Counters = M->getOrInsertGlobal(Profile->Name + ".prof", Type::getInt64Ty(Context));
+  Value *Ptr = Builder.CreateConstGEP1_32(Counters, Idx);
+  Value *N = Builder.CreateLoad(Ptr, "count");
+  Builder.CreateStore(Builder.CreateAdd(N, Builder.getInt64(1), "count"), Ptr);
+}
+
+uint64_t Session::getCount(unsigned Idx) const {
+  if(!Profile || Instrument) return 0;
+  return Profile->getCount(Idx);
+}
+
+void Session::WeighBranch(BranchInst *BI, uint64_t TrueCount, uint64_t FalseCount) {
+  if(!Profile || Instrument) return;
+  // Weights are 32 bits; keep the ratio.
+  while(TrueCount > 0xfffffffeu || FalseCount > 0xfffffffeu) {
+    TrueCount >>= 1;
+    FalseCount >>= 1;
+  }
+  BI->setMetadata(LLVMContext::MD_prof, MDBuilder(Context).createBranchWeights(TrueCount + 1, FalseCount + 1));
+}
+
+// Evaluation server
+
+namespace {
+// Accepted connections waiting for a worker.
+class ConnectionQueue {
+public:
+  void push(int Fd) {
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Fds.push_back(Fd);
+    }
+    Ready.notify_one();
+  }
+
+  int pop() {
+    std::unique_lock<std::mutex> Guard(Lock);
+    Ready.wait(Guard, [this] { return !Fds.empty(); });
+    int Fd = Fds.front();
+    Fds.pop_front();
+    return Fd;
+  }
+
+private:
+  std::mutex Lock;
+  std::condition_variable Ready;
+  std::deque<int> Fds;
+};
+}
+
+static bool isDefinition(const std::string &Source) {
+  Lexer L(Source.data(), Source.data() + Source.size());
+  int Tok = L.gettok();
+  return Tok == tok_def || Tok == tok_memo || Tok == tok_extern;
+}
+
+// Expressions a connection with local definitions keeps compiled; past
+// that, each is compiled for one evaluation and then freed.
+static const size_t MaxLocalEntries = 1024;
+
+// Answers requests on Fd until the client hangs up. Expressions go through
+// the shared cache until the connection makes a local definition; after
+// that they are compiled in the connection's own session, which sees both,
+// and cached there by source.
+static void serveConnection(CodeCache &Cache, int Fd) {
+  std::unique_ptr<Session> Local;
+  std::map<std::string, EntryFn> LocalEntries;
+  size_t DefsSeen = 0;
+  char Type;
+  std::string Payload;
+
+  while(toyproto::readFrame(Fd, Type, Payload)) {
+    std::string ErrMsg;
+    bool Ok;
+
+    switch(Type) {
+    case 'D':
+      Ok = Cache.define(Payload, &ErrMsg);
+      if(Ok) toyproto::writeFrame(Fd, 'K', 0, 0);
+      break;
+    case 'L':
+      if(!Local) {
+        Local.reset(new Session());
+        Local->Errors.Echo = false;
+      }
+      Cache.sync(*Local, DefsSeen);
+      Ok = Local->addDefinitions(Payload);
+      if(Ok) toyproto::writeFrame(Fd, 'K', 0, 0);
+      else ErrMsg = Local->Errors.Last;
+      break;
+    case 'E': {
+      if(isDefinition(Payload)) {
+        Ok = false;
+        ErrMsg = "expected an expression";
+        break;
+      }
+      EntryFn Entry = 0;
+      Function *OneShot = 0;
+      FunctionHandle H;
+      if(Local) {
+        Cache.sync(*Local, DefsSeen);
+        std::map<std::string, EntryFn>::iterator it = LocalEntries.find(Payload);
+        if(it != LocalEntries.end()) {
+          Entry = it->second;
+        } else {
+          unsigned NumArgs;
+          std::string DefName;
+          bool Keep = LocalEntries.size() < MaxLocalEntries;
+          // A one-shot expression needs a module of its own to be freed.
+          if(!Keep) Local->JITHelper->compilePending();
+          Entry = Local->compileEntry(Payload, NumArgs, DefName, Keep ? 0 : &OneShot);
+          if(!Entry) ErrMsg = Local->Errors.Last;
+          else if(Keep) LocalEntries[Payload] = Entry;
+        }
+      } else {
+        H = Cache.compile(Payload, &ErrMsg);
+      }
+      Ok = Entry || H;
+      if(Ok) {
+        double V = Entry ? Entry(0) : (*H)(0);
+        toyproto::writeFrame(Fd, 'V', &V, sizeof(V));
+      }
+      if(OneShot) Local->JITHelper->discard(OneShot->getParent());
+      break;
+    }
+    default:
+      Ok = false;
+      ErrMsg = std::string("unknown request type '") + Type + "'";
+      break;
+    }
+
+    if(!Ok) toyproto::writeFrame(Fd, 'X', ErrMsg);
+  }
+
+  close(Fd);
+}
+
+static int serve(const std::string &Path) {
+  sockaddr_un Addr;
+  memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  if(Path.size() >= sizeof(Addr.sun_path)) {
+    fprintf(stderr, "Socket path '%s' is too long\n", Path.c_str());
+    return 1;
+  }
+  strcpy(Addr.sun_path, Path.c_str());
+
+  // Only a stale socket is replaced, so a mistyped path cannot delete a
+  // file.
+  struct stat St;
+  if(lstat(Path.c_str(), &St) == 0) {
+    if(!S_ISSOCK(St.st_mode)) {
+      fprintf(stderr, "'%s' exists and is not a socket\n", Path.c_str());
+      return 1;
+    }
+    unlink(Path.c_str());
+  }
+
+  // Clients can extern any libc function, so only this user may connect;
+  // the socket is created 0600 rather than chmod-ed after the fact.
+  int Listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  mode_t OldMask = umask(0077);
+  bool Bound = Listener >= 0 && bind(Listener, (sockaddr *)&Addr, sizeof(Addr)) == 0;
+  umask(OldMask);
+  if(!Bound || listen(Listener, 128) < 0) {
+    fprintf(stderr, "Cannot listen on '%s': %s\n", Path.c_str(), strerror(errno));
+    return 1;
+  }
+
+  CodeCache Cache;
+  ConnectionQueue Queue;
+  std::vector<std::thread> Workers;
+  for(unsigned i = 0, e = std::max(1u, (unsigned)NumWorkers); i != e; ++i) {
+    Workers.push_back(std::thread([&Cache, &Queue] {
+      while(1) serveConnection(Cache, Queue.pop());
+    }));
+  }
+
+  fprintf(stderr, "Serving on %s with %u workers\n", Path.c_str(), (unsigned)Workers.size());
+  while(1) {
+    int Fd = accept(Listener, 0, 0);
+    if(Fd < 0) {
+      if(errno == EINTR || errno == ECONNABORTED) continue;
+      fprintf(stderr, "accept failed: %s\n", strerror(errno));
+      break;
+    }
+    Queue.push(Fd);
+  }
+
+  // Workers block forever on the queue; leave them to process exit.
+  for(unsigned i = 0, e = Workers.size(); i != e; ++i) Workers[i].detach();
+  close(Listener);
+  return 1;
+}
+
+//Lib
+
+// In runtime.cpp, which is also built to runtime.bc for -prelude.
+extern "C" double putchard(double x);
+
+// Session setup
+
+Session::Session()
+  : Builder(Context), Tiers(0), Profile(0), Instrument(false), NextCounter(0), TailRecurse(0), ValueGeneration(0),
+    CodegenDepth(0), KArrayTy(0) {
+  Builder.SetFastMathFlags(getFastMathFlags());
+
+  JITHelper = new MCJITHelper(Context, Errors);
+  JITHelper->addBuiltin("putchard", (void *)putchard);
+
+  BinopPrecedence['='] = 2;
   BinopPrecedence['<'] = 10;
   BinopPrecedence['+'] = 20;
   BinopPrecedence['-'] = 30;
   BinopPrecedence['*'] = 40;
+}
 
-  fprintf(stderr, "ready> ");
-  getNextToken();
+Session::~Session() {
+  // Stop tier 2 before the code it calls goes away.
+  delete Tiers;
+  delete JITHelper;
+}
+
+// Main
+
+
+int main(int argc, char **argv) {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope example program\n");
+
+  // The slot is the top N bits of a 64-bit hash: 0 would shift by 64.
+  if(MemoCacheBits < 1 || MemoCacheBits > 20) {
+    fprintf(stderr, "-memo-cache-bits must be between 1 and 20\n");
+    return 1;
+  }
+
+  if(!ServePath.empty()) return serve(ServePath);
+
+  if(Tiered && (!SnapshotPath.empty() || !EmitPrelude.empty())) {
+    fprintf(stderr, "-tiered code cannot be saved with -snapshot or -emit-prelude\n");
+    return 1;
+  }
+
+  if(LexBench) return lexBench(InputFile);
+  if(NumberBench) return numberBench();
 
-  MainLoop();
+  if(Watch && (InputFile == "-" || Tiered || Batch)) {
+    fprintf(stderr, "-watch needs an input file and cannot be combined with -tiered or -batch\n");
+    return 1;
+  }
+
+  FILE *In = stdin;
+  if(!Watch && !Batch && InputFile != "-" && !(In = fopen(InputFile.c_str(), "r"))) {
+    fprintf(stderr, "Cannot open '%s'\n", InputFile.c_str());
+    return 1;
+  }
 
-  JITHelper->dump();
+  // -array buffers belong to the host, as they would in an embedder, and
+  // outlive the session that borrows them.
+  std::vector<std::unique_ptr<double[]> > ArrayData;
+  Session S;
+  for(unsigned i = 0, e = HostArrays.size(); i != e; ++i) {
+    const std::string &Spec = HostArrays[i];
+    size_t Eq = Spec.find('=');
+    char *End = 0;
+    long long Len = Eq == std::string::npos ? -1 : strtoll(Spec.c_str() + Eq + 1, &End, 10);
+    if(Eq == 0 || Len < 0 || End == Spec.c_str() + Eq + 1 || *End) {
+      fprintf(stderr, "-array expects name=N, not '%s'\n", Spec.c_str());
+      return 1;
+    }
+    ArrayData.push_back(std::unique_ptr<double[]>(new double[Len]()));
+    S.JITHelper->bindArray(Spec.substr(0, Eq), ArrayData.back().get(), Len);
+  }
+  if(Tiered) S.enableTiering();
+  if(!RestorePath.empty() && !S.JITHelper->restore(RestorePath)) return 1;
+  Lexer L(In);
+
+  if(Watch) {
+    return S.watch(InputFile);
+  } else if(Batch) {
+    ErrorOr<std::unique_ptr<MemoryBuffer> > Input = MemoryBuffer::getFileOrSTDIN(InputFile);
+    if(!Input) {
+      fprintf(stderr, "Cannot read '%s': %s\n", InputFile.c_str(), Input.getError().message().c_str());
+      return 1;
+    }
+    bool Saving = !SnapshotPath.empty() || !EmitPrelude.empty();
+    S.runBatch((*Input)->getBuffer(), Exports, Saving && Exports.empty());
+  } else {
+    fprintf(stderr, "ready> ");
+    S.run(L);
+    S.JITHelper->dump();
+  }
+  if(!BatchKernel.empty() && kernelBench(S, BatchKernel, KernelRows)) return 1;
+  if(!SnapshotPath.empty() && !S.JITHelper->snapshot(SnapshotPath)) return 1;
+  if(!EmitPrelude.empty() && !S.JITHelper->emitPrelude(EmitPrelude)) return 1;
 
   //while(1) printf("%d\n", gettok());
   return 0;
@@ -0,0 +1,112 @@
+// Load generator for `toy -serve`: opens connections in parallel, sends
+// expressions as fast as replies come back and reports throughput and
+// latency percentiles.
+//
+//   toyload <socket-path> [-c connections] [-n requests] [-k keys]
+//
+// Each connection sends n requests cycling through k distinct expressions,
+// so -k 1 measures the cached path and a large -k the compile path.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sys/un.h>
+#include "toyproto.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static int connectTo(const char *Path) {
+  sockaddr_un Addr;
+  memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  strncpy(Addr.sun_path, Path, sizeof(Addr.sun_path) - 1);
+
+  int Fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(Fd < 0 || connect(Fd, (sockaddr *)&Addr, sizeof(Addr)) < 0) {
+    fprintf(stderr, "Cannot connect to '%s': %s\n", Path, strerror(errno));
+    exit(1);
+  }
+  return Fd;
+}
+
+// Sends one request and waits for its reply; false on a transport error.
+static bool request(int Fd, char Type, const std::string &Source, char &ReplyType, std::string &Reply) {
+  return toyproto::writeFrame(Fd, Type, Source) && toyproto::readFrame(Fd, ReplyType, Reply);
+}
+
+int main(int argc, char **argv) {
+  if(argc < 2) {
+    fprintf(stderr, "usage: %s <socket-path> [-c connections] [-n requests] [-k keys]\n", argv[0]);
+    return 1;
+  }
+  const char *Path = argv[1];
+  unsigned Conns = 8, Requests = 10000, Keys = 64;
+  for(int i = 2; i + 1 < argc; i += 2) {
+    std::string Flag = argv[i];
+    unsigned Val = atoi(argv[i + 1]);
+    if(Flag == "-c") Conns = std::max(1u, Val);
+    else if(Flag == "-n") Requests = std::max(1u, Val);
+    else if(Flag == "-k") Keys = std::max(1u, Val);
+    else {
+      fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+      return 1;
+    }
+  }
+
+  // One shared definition every expression calls.
+  char Type;
+  std::string Reply;
+  int Fd = connectTo(Path);
+  if(!request(Fd, 'D', "def loadpoly(x) 1 + x*(2 + x*(3 + x*(4 + x*5)));", Type, Reply) ||
+     (Type != 'K' && Reply.find("redefinition") == std::string::npos)) {
+    fprintf(stderr, "Setup failed: %s\n", Reply.c_str());
+    return 1;
+  }
+  close(Fd);
+
+  std::vector<std::vector<double> > Latencies(Conns);
+  std::vector<unsigned> Errors(Conns);
+  std::vector<std::thread> Threads;
+  Clock::time_point Start = Clock::now();
+  for(unsigned c = 0; c != Conns; ++c) {
+    Threads.push_back(std::thread([&, c] {
+      int Fd = connectTo(Path);
+      char Type;
+      std::string Reply;
+      char Expr[64];
+      Latencies[c].reserve(Requests);
+      for(unsigned i = 0; i != Requests; ++i) {
+        snprintf(Expr, sizeof(Expr), "loadpoly(%u);", (c + i) % Keys);
+        Clock::time_point T0 = Clock::now();
+        if(!request(Fd, 'E', Expr, Type, Reply)) {
+          fprintf(stderr, "Connection %u dropped\n", c);
+          break;
+        }
+        Latencies[c].push_back(std::chrono::duration<double, std::micro>(Clock::now() - T0).count());
+        if(Type != 'V') ++Errors[c];
+      }
+      close(Fd);
+    }));
+  }
+  for(unsigned c = 0; c != Conns; ++c) Threads[c].join();
+  double Seconds = std::chrono::duration<double>(Clock::now() - Start).count();
+
+  std::vector<double> All;
+  unsigned NumErrors = 0;
+  for(unsigned c = 0; c != Conns; ++c) {
+    All.insert(All.end(), Latencies[c].begin(), Latencies[c].end());
+    NumErrors += Errors[c];
+  }
+  if(All.empty()) return 1;
+  std::sort(All.begin(), All.end());
+
+  printf("%zu requests over %u connections in %.3f s: %.0f req/s, %u errors\n",
+         All.size(), Conns, Seconds, All.size() / Seconds, NumErrors);
+  printf("latency us: p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+         All[All.size() * 50 / 100], All[All.size() * 99 / 100],
+         All[All.size() * 999 / 1000], All.back());
+  return NumErrors != 0;
+}
@@ -0,0 +1,74 @@
+// Framing shared by `toy -serve` and the toyload client.
+//
+// A frame is a 4-byte payload length (host byte order), a 1-byte type and
+// the payload. Requests:
+//   'D' <source>   add defs/externs shared by every connection
+//   'L' <source>   add defs/externs visible to this connection only
+//   'E' <source>   evaluate a top-level expression
+// Replies:
+//   'V' <double>   value of an 'E'
+//   'K'            a 'D' or 'L' succeeded
+//   'X' <message>  the request failed
+#ifndef TOYPROTO_H
+#define TOYPROTO_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace toyproto {
+
+const uint32_t MaxPayload = 1 << 20;
+
+inline bool readFull(int Fd, void *Buf, size_t Len) {
+  char *P = (char *)Buf;
+  while(Len) {
+    ssize_t N = read(Fd, P, Len);
+    if(N < 0 && errno == EINTR) continue;
+    if(N <= 0) return false;
+    P += N;
+    Len -= N;
+  }
+  return true;
+}
+
+inline bool writeFull(int Fd, const void *Buf, size_t Len) {
+  const char *P = (const char *)Buf;
+  while(Len) {
+    ssize_t N = send(Fd, P, Len, MSG_NOSIGNAL);
+    if(N < 0 && errno == EINTR) continue;
+    if(N <= 0) return false;
+    P += N;
+    Len -= N;
+  }
+  return true;
+}
+
+inline bool readFrame(int Fd, char &Type, std::string &Payload) {
+  char Header[5];
+  if(!readFull(Fd, Header, sizeof(Header))) return false;
+  uint32_t Len;
+  memcpy(&Len, Header, 4);
+  if(Len > MaxPayload) return false;
+  Type = Header[4];
+  Payload.resize(Len);
+  return !Len || readFull(Fd, &Payload[0], Len);
+}
+
+inline bool writeFrame(int Fd, char Type, const void *Payload, uint32_t Len) {
+  char Header[5];
+  memcpy(Header, &Len, 4);
+  Header[4] = Type;
+  return writeFull(Fd, Header, sizeof(Header)) && (!Len || writeFull(Fd, Payload, Len));
+}
+
+inline bool writeFrame(int Fd, char Type, const std::string &Payload) {
+  return writeFrame(Fd, Type, Payload.data(), Payload.size());
+}
+
+} // end namespace toyproto
+
+#endif